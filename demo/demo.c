@@ -229,6 +229,8 @@ static int run_demo(void)
 		goto fail_qr_resize;
 	}
 
+	quirc_set_video_mode(qr, 1);
+
 	if (SDL_Init(SDL_INIT_VIDEO) < 0) {
 		perror("couldn't init SDL");
 		goto fail_sdl_init;
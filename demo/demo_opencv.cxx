@@ -190,6 +190,8 @@ static int run_demo(void)
 		goto fail_qr_resize;
 	}
 
+	quirc_set_video_mode(qr, 1);
+
 	if (main_loop(cap, qr) < 0) {
 		goto fail_main_loop;
 	}
@@ -131,6 +131,8 @@ static int run_scanner(void)
 		goto fail_qr_resize;
 	}
 
+	quirc_set_video_mode(qr, 1);
+
 	mjpeg_init(&mj);
 	if (main_loop(&cam, qr, &mj) < 0)
 		goto fail_main_loop;
@@ -25,19 +25,26 @@
  * Galois fields
  */
 
+/* Logs run from 1 to p, and the exp table covers two periods, so that
+ * the sum of two logs indexes it directly. Zero is given the log
+ * 2p + 1, past which the exp table is all zeroes, so that products
+ * with zero need no special case either.
+ */
 struct galois_field {
 	int p;
-	const uint8_t *log;
+	const uint16_t *log;
 	const uint8_t *exp;
 };
 
-static const uint8_t gf16_exp[16] = {
+static const uint8_t gf16_exp[64] = {
 	0x01, 0x02, 0x04, 0x08, 0x03, 0x06, 0x0c, 0x0b,
-	0x05, 0x0a, 0x07, 0x0e, 0x0f, 0x0d, 0x09, 0x01
+	0x05, 0x0a, 0x07, 0x0e, 0x0f, 0x0d, 0x09, 0x01,
+	0x02, 0x04, 0x08, 0x03, 0x06, 0x0c, 0x0b, 0x05,
+	0x0a, 0x07, 0x0e, 0x0f, 0x0d, 0x09, 0x01
 };
 
-static const uint8_t gf16_log[16] = {
-	0x00, 0x0f, 0x01, 0x04, 0x02, 0x08, 0x05, 0x0a,
+static const uint16_t gf16_log[16] = {
+	0x1f, 0x0f, 0x01, 0x04, 0x02, 0x08, 0x05, 0x0a,
 	0x03, 0x0e, 0x09, 0x07, 0x06, 0x0d, 0x0b, 0x0c
 };
 
@@ -47,7 +54,7 @@ static const struct galois_field gf16 = {
 	.exp = gf16_exp
 };
 
-static const uint8_t gf256_exp[256] = {
+static const uint8_t gf256_exp[1024] = {
 	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
 	0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26,
 	0x4c, 0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9,
@@ -79,11 +86,43 @@ static const uint8_t gf256_exp[256] = {
 	0x12, 0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5,
 	0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16,
 	0x2c, 0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83,
-	0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01
+	0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01,
+	0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d,
+	0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26, 0x4c,
+	0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f,
+	0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0, 0x9d,
+	0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a,
+	0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23, 0x46,
+	0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0, 0x5d,
+	0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1, 0x5f,
+	0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc, 0x65,
+	0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0, 0xfd,
+	0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f, 0xfe,
+	0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2, 0xd9,
+	0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0d,
+	0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce, 0x81,
+	0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93, 0x3b,
+	0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc, 0x85,
+	0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9, 0x4f,
+	0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54, 0xa8,
+	0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa, 0x49,
+	0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73, 0xe6,
+	0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e, 0xfc,
+	0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff, 0xe3,
+	0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4, 0x95,
+	0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41, 0x82,
+	0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e, 0x1c,
+	0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6, 0x51,
+	0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef, 0xc3,
+	0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09, 0x12,
+	0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5, 0xf7,
+	0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16, 0x2c,
+	0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83, 0x1b,
+	0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01
 };
 
-static const uint8_t gf256_log[256] = {
-	0x00, 0xff, 0x01, 0x19, 0x02, 0x32, 0x1a, 0xc6,
+static const uint16_t gf256_log[256] = {
+	0x1ff, 0xff, 0x01, 0x19, 0x02, 0x32, 0x1a, 0xc6,
 	0x03, 0xdf, 0x33, 0xee, 0x1b, 0x68, 0xc7, 0x4b,
 	0x04, 0x64, 0xe0, 0x0e, 0x34, 0x8d, 0xef, 0x81,
 	0x1c, 0xc1, 0x69, 0xf8, 0xc8, 0x08, 0x4c, 0x71,
@@ -123,6 +162,21 @@ static const struct galois_field gf256 = {
 	.exp = gf256_exp
 };
 
+static inline uint8_t gf_mul(const struct galois_field *gf,
+			     uint8_t a, uint8_t b)
+{
+	return gf->exp[gf->log[a] + gf->log[b]];
+}
+
+static inline uint8_t gf_div(const struct galois_field *gf,
+			     uint8_t a, uint8_t b)
+{
+	if (!a || !b)
+		return 0;
+
+	return gf->exp[gf->log[a] + gf->p - gf->log[b]];
+}
+
 /************************************************************************
  * Polynomial operations
  */
@@ -136,39 +190,93 @@ static void poly_add(uint8_t *dst, const uint8_t *src, uint8_t c,
 	if (!c)
 		return;
 
-	for (i = 0; i < MAX_POLY; i++) {
-		int p = i + shift;
-		uint8_t v = src[i];
-
-		if (p < 0 || p >= MAX_POLY)
-			continue;
-		if (!v)
-			continue;
-
-		dst[p] ^= gf->exp[(gf->log[v] + log_c) % gf->p];
-	}
+	for (i = 0; i + shift < MAX_POLY; i++)
+		dst[i + shift] ^= gf->exp[gf->log[src[i]] + log_c];
 }
 
 static uint8_t poly_eval(const uint8_t *s, uint8_t x,
 			 const struct galois_field *gf)
 {
+	int i = MAX_POLY - 1;
+	uint8_t sum;
+
+	while (i > 0 && !s[i])
+		i--;
+
+	/* Horner's rule, from the leading term down */
+	for (sum = s[i]; i > 0; i--)
+		sum = gf_mul(gf, sum, x) ^ s[i - 1];
+
+	return sum;
+}
+
+/* Evaluate a polynomial at alpha^first .. alpha^(first + count - 1).
+ * The coefficients are given from the highest power of x down. The
+ * evaluations proceed side by side by Horner's rule, each multiplying
+ * by a fixed power of alpha, which is an addition of logs.
+ */
+static int poly_syndromes(const uint8_t *c, int n, int first, int count,
+			  const struct galois_field *gf, uint8_t *s)
+{
+	int log_x[MAX_POLY];
+	uint8_t nonzero = 0;
 	int i;
-	uint8_t sum = 0;
-	uint8_t log_x = gf->log[x];
+	int j;
+
+	memset(s, 0, MAX_POLY);
 
-	if (!x)
-		return s[0];
+	for (i = 0; i < count; i++)
+		log_x[i] = (first + i) % gf->p;
+
+	for (j = 0; j < n; j++)
+		for (i = 0; i < count; i++)
+			s[i] = gf->exp[gf->log[s[i]] + log_x[i]] ^ c[j];
 
-	for (i = 0; i < MAX_POLY; i++) {
-		uint8_t c = s[i];
+	for (i = 0; i < count; i++)
+		nonzero |= s[i];
 
-		if (!c)
+	return nonzero != 0;
+}
+
+/* Chien search: find the i in [0, n) for which sigma(alpha^-i) is zero.
+ * Each term is carried as a log, and stepping from i to i + 1 takes a
+ * subtraction per term.
+ */
+static int chien_search(const uint8_t *sigma, int n,
+			const struct galois_field *gf, int *roots)
+{
+	int log_t[MAX_POLY];
+	int step[MAX_POLY];
+	int terms = 0;
+	int count = 0;
+	int i;
+	int k;
+
+	for (k = 1; k < MAX_POLY; k++) {
+		if (!sigma[k])
 			continue;
 
-		sum ^= gf->exp[(gf->log[c] + log_x * i) % gf->p];
+		log_t[terms] = gf->log[sigma[k]];
+		step[terms] = k % gf->p;
+		terms++;
 	}
 
-	return sum;
+	for (i = 0; i < n; i++) {
+		uint8_t sum = sigma[0];
+
+		for (k = 0; k < terms; k++) {
+			sum ^= gf->exp[log_t[k]];
+
+			log_t[k] -= step[k];
+			if (log_t[k] < 0)
+				log_t[k] += gf->p;
+		}
+
+		if (!sum)
+			roots[count++] = i;
+	}
+
+	return count;
 }
 
 /************************************************************************
@@ -196,20 +304,17 @@ static void berlekamp_massey(const uint8_t *s, int N,
 		uint8_t mult;
 		int i;
 
-		for (i = 1; i <= L; i++) {
-			if (!(C[i] && s[n - i]))
-				continue;
+		for (i = 1; i <= L; i++)
+			d ^= gf_mul(gf, C[i], s[n - i]);
 
-			d ^= gf->exp[(gf->log[C[i]] +
-				      gf->log[s[n - i]]) %
-				     gf->p];
+		if (!d) {
+			m++;
+			continue;
 		}
 
-		mult = gf->exp[(gf->p - gf->log[b] + gf->log[d]) % gf->p];
+		mult = gf_div(gf, d, b);
 
-		if (!d) {
-			m++;
-		} else if (L * 2 <= n) {
+		if (L * 2 <= n) {
 			uint8_t T[MAX_POLY];
 
 			memcpy(T, C, sizeof(T));
@@ -235,29 +340,7 @@ static void berlekamp_massey(const uint8_t *s, int N,
 
 static int block_syndromes(const uint8_t *data, int bs, int npar, uint8_t *s)
 {
-	int nonzero = 0;
-	int i;
-
-	memset(s, 0, MAX_POLY);
-
-	for (i = 0; i < npar; i++) {
-		int j;
-
-		for (j = 0; j < bs; j++) {
-			uint8_t c = data[bs - j - 1];
-
-			if (!c)
-				continue;
-
-			s[i] ^= gf256_exp[((int)gf256_log[c] +
-				    i * j) % 255];
-		}
-
-		if (s[i])
-			nonzero = 1;
-	}
-
-	return nonzero;
+	return poly_syndromes(data, bs, 0, npar, &gf256, s);
 }
 
 static void eloc_poly(uint8_t *omega,
@@ -269,25 +352,11 @@ static void eloc_poly(uint8_t *omega,
 	memset(omega, 0, MAX_POLY);
 
 	for (i = 0; i < npar; i++) {
-		const uint8_t a = sigma[i];
-		const uint8_t log_a = gf256_log[a];
+		const int log_a = gf256_log[sigma[i]];
 		int j;
 
-		if (!a)
-			continue;
-
-		for (j = 0; j + 1 < MAX_POLY; j++) {
-			const uint8_t b = s[j + 1];
-
-			if (i + j >= npar)
-				break;
-
-			if (!b)
-				continue;
-
-			omega[i + j] ^=
-			    gf256_exp[(log_a + gf256_log[b]) % 255];
-		}
+		for (j = 0; i + j < npar; j++)
+			omega[i + j] ^= gf256_exp[log_a + gf256_log[s[j + 1]]];
 	}
 }
 
@@ -299,6 +368,8 @@ static quirc_decode_error_t correct_block(uint8_t *data,
 	uint8_t sigma[MAX_POLY];
 	uint8_t sigma_deriv[MAX_POLY];
 	uint8_t omega[MAX_POLY];
+	int roots[MAX_POLY];
+	int count;
 	int i;
 
 	/* Compute syndrome vector */
@@ -316,17 +387,14 @@ static quirc_decode_error_t correct_block(uint8_t *data,
 	eloc_poly(omega, s, sigma, npar - 1);
 
 	/* Find error locations and magnitudes */
-	for (i = 0; i < ecc->bs; i++) {
-		uint8_t xinv = gf256_exp[255 - i];
+	count = chien_search(sigma, ecc->bs, &gf256, roots);
 
-		if (!poly_eval(sigma, xinv, &gf256)) {
-			uint8_t sd_x = poly_eval(sigma_deriv, xinv, &gf256);
-			uint8_t omega_x = poly_eval(omega, xinv, &gf256);
-			uint8_t error = gf256_exp[(255 - gf256_log[sd_x] +
-						   gf256_log[omega_x]) % 255];
+	for (i = 0; i < count; i++) {
+		uint8_t xinv = gf256_exp[255 - roots[i]];
+		uint8_t sd_x = poly_eval(sigma_deriv, xinv, &gf256);
+		uint8_t omega_x = poly_eval(omega, xinv, &gf256);
 
-			data[ecc->bs - i - 1] ^= error;
-		}
+		data[ecc->bs - roots[i] - 1] ^= gf_div(&gf256, omega_x, sd_x);
 	}
 
 	if (block_syndromes(data, ecc->bs, npar, s))
@@ -347,24 +415,13 @@ static quirc_decode_error_t correct_block(uint8_t *data,
 
 static int format_syndromes(uint16_t u, uint8_t *s)
 {
-	int i;
-	int nonzero = 0;
+	uint8_t c[FORMAT_BITS];
+	int j;
 
-	memset(s, 0, MAX_POLY);
+	for (j = 0; j < FORMAT_BITS; j++)
+		c[FORMAT_BITS - j - 1] = (u >> j) & 1;
 
-	for (i = 0; i < FORMAT_SYNDROMES; i++) {
-		int j;
-
-		s[i] = 0;
-		for (j = 0; j < FORMAT_BITS; j++)
-			if (u & (1 << j))
-				s[i] ^= gf16_exp[((i + 1) * j) % 15];
-
-		if (s[i])
-			nonzero = 1;
-	}
-
-	return nonzero;
+	return poly_syndromes(c, FORMAT_BITS, 1, FORMAT_SYNDROMES, &gf16, s);
 }
 
 static quirc_decode_error_t correct_format(uint16_t *f_ret)
@@ -373,6 +430,8 @@ static quirc_decode_error_t correct_format(uint16_t *f_ret)
 	int i;
 	uint8_t s[MAX_POLY];
 	uint8_t sigma[MAX_POLY];
+	int roots[FORMAT_BITS];
+	int count;
 
 	/* Evaluate U (received codeword) at each of alpha_1 .. alpha_6
 	 * to get S_1 .. S_6 (but we index them from 0).
@@ -383,9 +442,9 @@ static quirc_decode_error_t correct_format(uint16_t *f_ret)
 	berlekamp_massey(s, FORMAT_SYNDROMES, &gf16, sigma);
 
 	/* Now, find the roots of the polynomial */
-	for (i = 0; i < 15; i++)
-		if (!poly_eval(sigma, gf16_exp[15 - i], &gf16))
-			u ^= (1 << i);
+	count = chien_search(sigma, FORMAT_BITS, &gf16, roots);
+	for (i = 0; i < count; i++)
+		u ^= (1 << roots[i]);
 
 	if (format_syndromes(u, s))
 		return QUIRC_ERROR_FORMAT_ECC;
@@ -403,6 +462,10 @@ struct datastream {
 	int		data_bits;
 	int		ptr;
 
+	/* The bits following ptr, left-aligned */
+	uint64_t	window;
+	int		window_bits;
+
 	uint8_t         data[QUIRC_MAX_PAYLOAD];
 };
 
@@ -452,119 +515,278 @@ static quirc_decode_error_t read_format(const struct quirc_code *code,
 	return QUIRC_SUCCESS;
 }
 
-static int mask_bit(int mask, int i, int j)
+/* The data masks, for row i and column j:
+ *
+ *     0: (i + j) % 2 == 0
+ *     1: i % 2 == 0
+ *     2: j % 3 == 0
+ *     3: (i + j) % 3 == 0
+ *     4: (i / 2 + j / 3) % 2 == 0
+ *     5: (i * j) % 2 + (i * j) % 3 == 0
+ *     6: ((i * j) % 2 + (i * j) % 3) % 2 == 0
+ *     7: ((i * j) % 3 + (i + j) % 2) % 2 == 0
+ *
+ * All of them repeat every 12 rows and 6 columns. mask_rows[m][i % 12]
+ * holds the first six columns of row i of mask m, column 0 in bit 0.
+ */
+static const uint8_t mask_rows[8][12] = {
+	{ 0x15, 0x2a, 0x15, 0x2a, 0x15, 0x2a,
+	  0x15, 0x2a, 0x15, 0x2a, 0x15, 0x2a },
+	{ 0x3f, 0x00, 0x3f, 0x00, 0x3f, 0x00,
+	  0x3f, 0x00, 0x3f, 0x00, 0x3f, 0x00 },
+	{ 0x09, 0x09, 0x09, 0x09, 0x09, 0x09,
+	  0x09, 0x09, 0x09, 0x09, 0x09, 0x09 },
+	{ 0x09, 0x24, 0x12, 0x09, 0x24, 0x12,
+	  0x09, 0x24, 0x12, 0x09, 0x24, 0x12 },
+	{ 0x07, 0x07, 0x38, 0x38, 0x07, 0x07,
+	  0x38, 0x38, 0x07, 0x07, 0x38, 0x38 },
+	{ 0x3f, 0x01, 0x09, 0x15, 0x09, 0x01,
+	  0x3f, 0x01, 0x09, 0x15, 0x09, 0x01 },
+	{ 0x3f, 0x07, 0x1b, 0x15, 0x2d, 0x31,
+	  0x3f, 0x07, 0x1b, 0x15, 0x2d, 0x31 },
+	{ 0x15, 0x38, 0x31, 0x2a, 0x07, 0x0e,
+	  0x15, 0x38, 0x31, 0x2a, 0x07, 0x0e }
+};
+
+/* The cell bitmap, as 64-bit words with cell 0 in the least significant
+ * bit of the first, and room for the mask to spill over the last.
+ */
+#define GRID_WORDS ((QUIRC_MAX_GRID_SIZE * QUIRC_MAX_GRID_SIZE + 63) / 64 + 1)
+
+static inline int grid_word_bit(const uint64_t *grid, int p)
+{
+	return (grid[p >> 6] >> (p & 63)) & 1;
+}
+
+static void load_grid(const struct quirc_code *code, uint64_t *grid)
 {
-	switch (mask) {
-	case 0: return !((i + j) % 2);
-	case 1: return !(i % 2);
-	case 2: return !(j % 3);
-	case 3: return !((i + j) % 3);
-	case 4: return !(((i / 2) + (j / 3)) % 2);
-	case 5: return !((i * j) % 2 + (i * j) % 3);
-	case 6: return !(((i * j) % 2 + (i * j) % 3) % 2);
-	case 7: return !(((i * j) % 3 + (i + j) % 2) % 2);
+	const int len = (code->size * code->size + 7) / 8;
+	int i;
+
+	memset(grid, 0, GRID_WORDS * sizeof(grid[0]));
+
+	for (i = 0; i < len; i++)
+		grid[i >> 3] |= (uint64_t)code->cell_bitmap[i] << ((i & 7) * 8);
+}
+
+/* The mask for 64 columns of a row, starting at column j, given the
+ * row's first six columns. Repeating six bits by multiplication can't
+ * carry, as the copies don't overlap.
+ */
+static inline uint64_t mask_word(unsigned int row, int j)
+{
+	const int r = j % 6;
+	const uint64_t six = ((row >> r) | (row << (6 - r))) & 0x3f;
+
+	return six * 0x1041041041041041ull;
+}
+
+/* Apply the data mask to the whole grid, 64 cells at a time. Function
+ * patterns are masked too, but they aren't read afterwards.
+ */
+static void apply_mask(uint64_t *grid, int size, int mask)
+{
+	int i, j;
+
+	for (i = 0; i < size; i++) {
+		const unsigned int row = mask_rows[mask][i % 12];
+
+		for (j = 0; j < size; j += 64) {
+			const int p = i * size + j;
+			uint64_t w = mask_word(row, j);
+
+			if (size - j < 64)
+				w &= ((uint64_t)1 << (size - j)) - 1;
+
+			grid[p >> 6] ^= w << (p & 63);
+			if (p & 63)
+				grid[(p >> 6) + 1] ^= w >> (64 - (p & 63));
+		}
 	}
+}
+
+/* Set n consecutive bits of a bitmap, starting at bit p */
+static void set_cells(uint64_t *map, int p, int n)
+{
+	while (n > 0) {
+		const int k = n < 64 - (p & 63) ? n : 64 - (p & 63);
+		const uint64_t bits = k < 64 ? ((uint64_t)1 << k) - 1 : ~0ull;
 
-	return 0;
+		map[p >> 6] |= bits << (p & 63);
+		p += k;
+		n -= k;
+	}
 }
 
-static int reserved_cell(int version, int i, int j)
+#define COLUMN_WORDS ((QUIRC_MAX_GRID_SIZE + 63) / 64)
+
+/* Mark the rows of column x which belong to a function pattern, and so
+ * hold no data. The zigzag path only ever needs two columns at a time,
+ * so there's no need for a map of the whole grid.
+ */
+static void column_patterns(int version, int x, uint64_t *col)
 {
 	const struct quirc_version_info *ver = &quirc_version_db[version];
-	int size = version * 4 + 17;
-	int ai = -1, aj = -1, a;
+	const int size = version * 4 + 17;
+	int count = 0;
+	int a, b;
 
-	/* Finder + format: top left */
-	if (i < 9 && j < 9)
-		return 1;
+	memset(col, 0, COLUMN_WORDS * sizeof(col[0]));
 
-	/* Finder + format: bottom left */
-	if (i + 8 >= size && j < 9)
-		return 1;
-
-	/* Finder + format: top right */
-	if (i < 9 && j + 8 >= size)
-		return 1;
+	if (x == 6) {
+		set_cells(col, 0, size);
+		return;
+	}
 
-	/* Exclude timing patterns */
-	if (i == 6 || j == 6)
-		return 1;
+	/* Finders, format information and the timing pattern */
+	if (x < 9 || x >= size - 8)
+		set_cells(col, 0, 9);
+	if (x < 9)
+		set_cells(col, size - 8, 8);
+	set_cells(col, 6, 1);
 
-	/* Exclude version info, if it exists. Version info sits adjacent to
-	 * the top-right and bottom-left finders in three rows, bounded by
-	 * the timing pattern.
+	/* Version information, next to the top-right and bottom-left
+	 * finders.
 	 */
 	if (version >= 7) {
-		if (i < 6 && j + 11 >= size)
-			return 1;
-		if (i + 11 >= size && j < 6)
-			return 1;
+		if (x >= size - 11 && x < size - 8)
+			set_cells(col, 0, 6);
+		if (x < 6)
+			set_cells(col, size - 11, 3);
 	}
 
-	/* Exclude alignment patterns */
-	for (a = 0; a < QUIRC_MAX_ALIGNMENT && ver->apat[a]; a++) {
-		int p = ver->apat[a];
+	/* Alignment patterns, except where they'd overlap the finders */
+	while (count < QUIRC_MAX_ALIGNMENT && ver->apat[count])
+		count++;
 
-		if (abs(p - i) < 3)
-			ai = a;
-		if (abs(p - j) < 3)
-			aj = a;
-	}
+	for (b = 0; b < count; b++) {
+		if (x < ver->apat[b] - 2 || x > ver->apat[b] + 2)
+			continue;
 
-	if (ai >= 0 && aj >= 0) {
-		a--;
-		if (ai > 0 && ai < a)
-			return 1;
-		if (aj > 0 && aj < a)
-			return 1;
-		if (aj == a && ai == a)
-			return 1;
+		for (a = 0; a < count; a++) {
+			if ((!a || a == count - 1) && !b)
+				continue;
+			if (!a && b == count - 1)
+				continue;
+
+			set_cells(col, ver->apat[a] - 2, 5);
+		}
 	}
+}
+
+/* Codewords are interleaved across the error correction blocks: the
+ * first data codeword of each block in turn, then the second, and so
+ * on, then the ECC codewords likewise. The short blocks come first,
+ * and the long ones have one more data codeword. A cursor follows
+ * that order, and gives each codeword's offset with the blocks stored
+ * one after another.
+ */
+struct codeword_cursor {
+	const struct quirc_rs_params	*sb;
+	int				blocks;
+	int				block;
+	int				index;
+	int				ecc;
+};
+
+static int codeword_offset(const struct codeword_cursor *c)
+{
+	const struct quirc_rs_params *sb = c->sb;
+	const int longs = c->block > sb->ns ? c->block - sb->ns : 0;
+	int offset = c->block * sb->bs + longs + c->index;
+
+	if (c->ecc)
+		offset += sb->dw + (c->block >= sb->ns);
 
-	return 0;
+	return offset;
 }
 
-static void read_bit(const struct quirc_code *code,
-		     struct quirc_data *data,
-		     struct datastream *ds, int i, int j)
+static void next_codeword(struct codeword_cursor *c)
 {
-	int bitpos = ds->data_bits & 7;
-	int bytepos = ds->data_bits >> 3;
-	int v = grid_bit(code, j, i);
+	const struct quirc_rs_params *sb = c->sb;
 
-	if (mask_bit(data->mask, i, j))
-		v ^= 1;
+	for (;;) {
+		if (++c->block == c->blocks) {
+			c->block = 0;
+			c->index++;
+		}
+
+		if (c->ecc)
+			return;
 
-	if (v)
-		ds->raw[bytepos] |= (0x80 >> bitpos);
+		if (c->index > sb->dw) {
+			c->ecc = 1;
+			c->index = 0;
+			return;
+		}
 
-	ds->data_bits++;
+		if (c->index < sb->dw + (c->block >= sb->ns))
+			return;
+	}
 }
 
+/* Read the codewords along the zigzag path through the grid, skipping
+ * the function patterns, and store each straight into its block.
+ */
 static void read_data(const struct quirc_code *code,
 		      struct quirc_data *data,
 		      struct datastream *ds)
 {
-	int y = code->size - 1;
-	int x = code->size - 1;
+	const struct quirc_version_info *ver =
+		&quirc_version_db[data->version];
+	const struct quirc_rs_params *sb = &ver->ecc[data->ecc_level];
+	const int size = code->size;
+	struct codeword_cursor cursor;
+	uint64_t grid[GRID_WORDS];
+	uint64_t reserved[2][COLUMN_WORDS];
+	unsigned int byte = 0;
+	int count = 0;
+	int bits = 0;
+	int y = size - 1;
+	int x = size - 1;
 	int dir = -1;
 
-	while (x > 0) {
+	load_grid(code, grid);
+	apply_mask(grid, size, data->mask);
+
+	cursor.sb = sb;
+	cursor.blocks = sb->ns +
+		(ver->data_bytes - sb->bs * sb->ns) / (sb->bs + 1);
+	cursor.block = 0;
+	cursor.index = 0;
+	cursor.ecc = 0;
+
+	while (x > 0 && count < ver->data_bytes) {
 		if (x == 6)
 			x--;
 
-		if (!reserved_cell(data->version, y, x))
-			read_bit(code, data, ds, y, x);
+		column_patterns(data->version, x, reserved[0]);
+		column_patterns(data->version, x - 1, reserved[1]);
 
-		if (!reserved_cell(data->version, y, x - 1))
-			read_bit(code, data, ds, y, x - 1);
+		for (; y >= 0 && y < size; y += dir) {
+			int k;
 
-		y += dir;
-		if (y < 0 || y >= code->size) {
-			dir = -dir;
-			x -= 2;
-			y += dir;
+			for (k = 0; k < 2; k++) {
+				const int p = y * size + x - k;
+
+				if (grid_word_bit(reserved[k], y))
+					continue;
+
+				byte = (byte << 1) | grid_word_bit(grid, p);
+				if (++bits < 8)
+					continue;
+
+				ds->raw[codeword_offset(&cursor)] = byte;
+				next_codeword(&cursor);
+				count++;
+				byte = 0;
+				bits = 0;
+			}
 		}
+
+		dir = -dir;
+		x -= 2;
+		y += dir;
 	}
 }
 
@@ -578,7 +800,7 @@ static quirc_decode_error_t codestream_ecc(struct quirc_data *data,
 	const int lb_count =
 	    (ver->data_bytes - sb_ecc->bs * sb_ecc->ns) / (sb_ecc->bs + 1);
 	const int bc = lb_count + sb_ecc->ns;
-	const int ecc_offset = sb_ecc->dw * bc + lb_count;
+	int src_offset = 0;
 	int dst_offset = 0;
 	int i;
 
@@ -586,23 +808,19 @@ static quirc_decode_error_t codestream_ecc(struct quirc_data *data,
 	lb_ecc.dw++;
 	lb_ecc.bs++;
 
+	/* read_data() has already sorted the codewords into blocks */
 	for (i = 0; i < bc; i++) {
-		uint8_t *dst = ds->data + dst_offset;
+		uint8_t *src = ds->raw + src_offset;
 		const struct quirc_rs_params *ecc =
 		    (i < sb_ecc->ns) ? sb_ecc : &lb_ecc;
-		const int num_ec = ecc->bs - ecc->dw;
 		quirc_decode_error_t err;
-		int j;
-
-		for (j = 0; j < ecc->dw; j++)
-			dst[j] = ds->raw[j * bc + i];
-		for (j = 0; j < num_ec; j++)
-			dst[ecc->dw + j] = ds->raw[ecc_offset + j * bc + i];
 
-		err = correct_block(dst, ecc);
+		err = correct_block(src, ecc);
 		if (err)
 			return err;
 
+		memcpy(ds->data + dst_offset, src, ecc->dw);
+		src_offset += ecc->bs;
 		dst_offset += ecc->dw;
 	}
 
@@ -616,51 +834,66 @@ static inline int bits_remaining(const struct datastream *ds)
 	return ds->data_bits - ds->ptr;
 }
 
+/* Refill the window so that it holds at least 57 bits */
+static void refill_window(struct datastream *ds)
+{
+	while (ds->window_bits <= 56) {
+		const int p = ds->ptr + ds->window_bits;
+		const uint8_t b = ds->data[p >> 3] << (p & 7);
+
+		ds->window |= (uint64_t)b << (56 - ds->window_bits);
+		ds->window_bits += 8 - (p & 7);
+	}
+}
+
 static int take_bits(struct datastream *ds, int len)
 {
-	int ret = 0;
+	int ret;
 
-	while (len && (ds->ptr < ds->data_bits)) {
-		uint8_t b = ds->data[ds->ptr >> 3];
-		int bitpos = ds->ptr & 7;
+	if (len > bits_remaining(ds))
+		len = bits_remaining(ds);
+	if (len <= 0)
+		return 0;
 
-		ret <<= 1;
-		if ((b << bitpos) & 0x80)
-			ret |= 1;
+	if (ds->window_bits < len)
+		refill_window(ds);
 
-		ds->ptr++;
-		len--;
-	}
+	ret = ds->window >> (64 - len);
+	ds->window <<= len;
+	ds->window_bits -= len;
+	ds->ptr += len;
 
 	return ret;
 }
 
-static int numeric_tuple(struct quirc_data *data,
-			 struct datastream *ds,
-			 int bits, int digits)
+/* Move to an arbitrary bit position, discarding the window */
+static void seek_bits(struct datastream *ds, int ptr)
 {
-	int tuple;
-	int i;
-
-	if (bits_remaining(ds) < bits)
-		return -1;
+	ds->ptr = ptr;
+	ds->window = 0;
+	ds->window_bits = 0;
+}
 
-	tuple = take_bits(ds, bits);
+/* Every digit triplet from "000" to "999", in order */
+#define NUMERIC_1(p) \
+	p"0" p"1" p"2" p"3" p"4" p"5" p"6" p"7" p"8" p"9"
+#define NUMERIC_2(p) \
+	NUMERIC_1(p"0") NUMERIC_1(p"1") NUMERIC_1(p"2") NUMERIC_1(p"3") \
+	NUMERIC_1(p"4") NUMERIC_1(p"5") NUMERIC_1(p"6") NUMERIC_1(p"7") \
+	NUMERIC_1(p"8") NUMERIC_1(p"9")
 
-	for (i = digits - 1; i >= 0; i--) {
-		data->payload[data->payload_len + i] = tuple % 10 + '0';
-		tuple /= 10;
-	}
-
-	data->payload_len += digits;
-	return 0;
-}
+static const char numeric_triplets[] =
+	NUMERIC_2("0") NUMERIC_2("1") NUMERIC_2("2") NUMERIC_2("3")
+	NUMERIC_2("4") NUMERIC_2("5") NUMERIC_2("6") NUMERIC_2("7")
+	NUMERIC_2("8") NUMERIC_2("9");
 
 static quirc_decode_error_t decode_numeric(struct quirc_data *data,
 					   struct datastream *ds)
 {
 	int bits = 14;
 	int count;
+	int need;
+	int tuple;
 
 	if (data->version < 10)
 		bits = 10;
@@ -671,57 +904,58 @@ static quirc_decode_error_t decode_numeric(struct quirc_data *data,
 	if (data->payload_len + count + 1 > QUIRC_MAX_PAYLOAD)
 		return QUIRC_ERROR_DATA_OVERFLOW;
 
+	/* Groups of three digits take 10 bits, and a final group of one
+	 * or two takes 4 or 7 bits.
+	 */
+	need = count / 3 * 10 + (count % 3) * 3 + !!(count % 3);
+	if (bits_remaining(ds) < need)
+		return QUIRC_ERROR_DATA_UNDERFLOW;
+
 	while (count >= 3) {
-		if (numeric_tuple(data, ds, 10, 3) < 0)
-			return QUIRC_ERROR_DATA_UNDERFLOW;
+		tuple = take_bits(ds, 10) % 1000;
+		memcpy(data->payload + data->payload_len,
+		       numeric_triplets + tuple * 3, 3);
+		data->payload_len += 3;
 		count -= 3;
 	}
 
-	if (count >= 2) {
-		if (numeric_tuple(data, ds, 7, 2) < 0)
-			return QUIRC_ERROR_DATA_UNDERFLOW;
-		count -= 2;
-	}
-
 	if (count) {
-		if (numeric_tuple(data, ds, 4, 1) < 0)
-			return QUIRC_ERROR_DATA_UNDERFLOW;
-		count--;
+		const int modulus = count > 1 ? 100 : 10;
+
+		tuple = take_bits(ds, count * 3 + 1) % modulus;
+		memcpy(data->payload + data->payload_len,
+		       numeric_triplets + tuple * 3 + 3 - count, count);
+		data->payload_len += count;
 	}
 
 	return QUIRC_SUCCESS;
 }
 
-static int alpha_tuple(struct quirc_data *data,
-		       struct datastream *ds,
-		       int bits, int digits)
-{
-	int tuple;
-	int i;
-
-	if (bits_remaining(ds) < bits)
-		return -1;
-
-	tuple = take_bits(ds, bits);
-
-	for (i = 0; i < digits; i++) {
-		static const char *alpha_map =
-			"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:";
-
-		data->payload[data->payload_len + digits - i - 1] =
-			alpha_map[tuple % 45];
-		tuple /= 45;
-	}
-
-	data->payload_len += digits;
-	return 0;
-}
+/* Every pair of alphanumeric characters, in order of value */
+#define ALPHA_1(p) \
+	p"0" p"1" p"2" p"3" p"4" p"5" p"6" p"7" p"8" p"9" p"A" p"B" p"C" \
+	p"D" p"E" p"F" p"G" p"H" p"I" p"J" p"K" p"L" p"M" p"N" p"O" p"P" \
+	p"Q" p"R" p"S" p"T" p"U" p"V" p"W" p"X" p"Y" p"Z" p" " p"$" p"%" \
+	p"*" p"+" p"-" p"." p"/" p":"
+#define ALPHA_2 \
+	ALPHA_1("0") ALPHA_1("1") ALPHA_1("2") ALPHA_1("3") ALPHA_1("4") \
+	ALPHA_1("5") ALPHA_1("6") ALPHA_1("7") ALPHA_1("8") ALPHA_1("9") \
+	ALPHA_1("A") ALPHA_1("B") ALPHA_1("C") ALPHA_1("D") ALPHA_1("E") \
+	ALPHA_1("F") ALPHA_1("G") ALPHA_1("H") ALPHA_1("I") ALPHA_1("J") \
+	ALPHA_1("K") ALPHA_1("L") ALPHA_1("M") ALPHA_1("N") ALPHA_1("O") \
+	ALPHA_1("P") ALPHA_1("Q") ALPHA_1("R") ALPHA_1("S") ALPHA_1("T") \
+	ALPHA_1("U") ALPHA_1("V") ALPHA_1("W") ALPHA_1("X") ALPHA_1("Y") \
+	ALPHA_1("Z") ALPHA_1(" ") ALPHA_1("$") ALPHA_1("%") ALPHA_1("*") \
+	ALPHA_1("+") ALPHA_1("-") ALPHA_1(".") ALPHA_1("/") ALPHA_1(":")
+
+static const char alpha_pairs[] = ALPHA_2;
 
 static quirc_decode_error_t decode_alpha(struct quirc_data *data,
 					 struct datastream *ds)
 {
 	int bits = 13;
 	int count;
+	int tuple;
 
 	if (data->version < 10)
 		bits = 9;
@@ -732,27 +966,72 @@ static quirc_decode_error_t decode_alpha(struct quirc_data *data,
 	if (data->payload_len + count + 1 > QUIRC_MAX_PAYLOAD)
 		return QUIRC_ERROR_DATA_OVERFLOW;
 
+	/* Pairs take 11 bits, and a final single character takes 6 */
+	if (bits_remaining(ds) < count / 2 * 11 + (count & 1) * 6)
+		return QUIRC_ERROR_DATA_UNDERFLOW;
+
 	while (count >= 2) {
-		if (alpha_tuple(data, ds, 11, 2) < 0)
-			return QUIRC_ERROR_DATA_UNDERFLOW;
+		tuple = take_bits(ds, 11) % 2025;
+		memcpy(data->payload + data->payload_len,
+		       alpha_pairs + tuple * 2, 2);
+		data->payload_len += 2;
 		count -= 2;
 	}
 
 	if (count) {
-		if (alpha_tuple(data, ds, 6, 1) < 0)
-			return QUIRC_ERROR_DATA_UNDERFLOW;
-		count--;
+		tuple = take_bits(ds, 6) % 45;
+		data->payload[data->payload_len++] = alpha_pairs[tuple * 2 + 1];
 	}
 
 	return QUIRC_SUCCESS;
 }
 
+/* Big-endian word access, for copying unaligned byte data */
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define be64(w) __builtin_bswap64(w)
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define be64(w) (w)
+#endif
+
+static inline uint64_t load_be64(const uint8_t *p)
+{
+	uint64_t w = 0;
+#ifdef be64
+	memcpy(&w, p, sizeof(w));
+	w = be64(w);
+#else
+	int i;
+
+	for (i = 0; i < 8; i++)
+		w = (w << 8) | p[i];
+#endif
+	return w;
+}
+
+static inline void store_be64(uint8_t *p, uint64_t w)
+{
+#ifdef be64
+	w = be64(w);
+	memcpy(p, &w, sizeof(w));
+#else
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = w >> (56 - i * 8);
+#endif
+}
+
 static quirc_decode_error_t decode_byte(struct quirc_data *data,
 					struct datastream *ds)
 {
 	int bits = 16;
+	uint8_t *dst;
+	const uint8_t *src;
+	int shift;
 	int count;
-	int i;
+	int i = 0;
 
 	if (data->version < 10)
 		bits = 8;
@@ -763,8 +1042,28 @@ static quirc_decode_error_t decode_byte(struct quirc_data *data,
 	if (bits_remaining(ds) < count * 8)
 		return QUIRC_ERROR_DATA_UNDERFLOW;
 
-	for (i = 0; i < count; i++)
-		data->payload[data->payload_len++] = take_bits(ds, 8);
+	/* Copy straight out of the data buffer, a word at a time when
+	 * the bytes straddle byte boundaries. The data buffer is much
+	 * larger than any data stream, so reading a byte beyond the
+	 * end is harmless.
+	 */
+	dst = data->payload + data->payload_len;
+	src = ds->data + (ds->ptr >> 3);
+	shift = ds->ptr & 7;
+
+	if (!shift) {
+		memcpy(dst, src, count);
+	} else {
+		for (; i + 8 <= count; i += 8)
+			store_be64(dst + i, (load_be64(src + i) << shift) |
+				   (src[i + 8] >> (8 - shift)));
+
+		for (; i < count; i++)
+			dst[i] = (src[i] << shift) | (src[i + 1] >> (8 - shift));
+	}
+
+	data->payload_len += count;
+	seek_bits(ds, ds->ptr + count * 8);
 
 	return QUIRC_SUCCESS;
 }
@@ -16,7 +16,6 @@
 
 #include <limits.h>
 #include <string.h>
-#include <stdbool.h>
 #include <stdlib.h>
 #ifdef QUIRC_USE_TGMATH
 #include <tgmath.h>
@@ -25,6 +24,10 @@
 #endif // QUIRC_USE_TGMATH
 #include "quirc_internal.h"
 
+#ifdef QUIRC_THREADS
+#include <pthread.h>
+#endif
+
 /************************************************************************
  * Linear algebra routines
  */
@@ -108,6 +111,17 @@ static void perspective_map(const quirc_float_t *c,
 	ret->y = (int) rint(y);
 }
 
+/* As perspective_map(), but without rounding to whole pixels. */
+static void perspective_project(const quirc_float_t *c,
+				quirc_float_t u, quirc_float_t v,
+				quirc_float_t *x, quirc_float_t *y)
+{
+	quirc_float_t den = (quirc_float_t)1 / (c[6]*u + c[7]*v + (quirc_float_t)1.0);
+
+	*x = (c[0]*u + c[1]*v + c[2]) * den;
+	*y = (c[3]*u + c[4]*v + c[5]) * den;
+}
+
 static void perspective_unmap(const quirc_float_t *c,
 			      const struct quirc_point *in,
 			      quirc_float_t *u, quirc_float_t *v)
@@ -124,184 +138,358 @@ static void perspective_unmap(const quirc_float_t *c,
 }
 
 /************************************************************************
- * Span-based floodfill routine
+ * Connected-component labelling
+ *
+ * Black runs are merged into 4-connected components as each row is
+ * extracted, using a union-find over the component table. By the time
+ * the whole image has been thresholded, every component knows its
+ * area, seed, bounding box and list of runs, so looking up a region or
+ * walking its pixels never needs a flood fill.
  */
 
 typedef void (*span_func_t)(void *user_data, int y, int left, int right);
 
-static void flood_fill_line(struct quirc *q, int x, int y,
-			    int from, int to,
-			    span_func_t func, void *user_data,
-			    int *leftp, int *rightp)
+/* Make room for count more entries in a table of used entries, doubling
+ * its capacity as necessary. A table which hasn't been allocated yet is
+ * always given some room, so that reserving no entries succeeds too.
+ * Returns the (possibly moved) table, or NULL if it can't be grown.
+ */
+static void *table_reserve(void *table, int *max, int used, int count,
+			   size_t size)
 {
-	quirc_pixel_t *row;
-	int left;
-	int right;
-	int i;
+	int new_max = *max;
 
-	row = q->pixels + y * q->w;
-	QUIRC_ASSERT(row[x] == from);
+	if (table && used <= new_max - count)
+		return table;
 
-	left = x;
-	right = x;
+	while (!new_max || new_max - used < count) {
+		if (new_max > INT_MAX / 2)
+			return NULL;
+		new_max = new_max ? new_max * 2 : 16;
+	}
 
-	while (left > 0 && row[left - 1] == from)
-		left--;
+	table = realloc(table, size * new_max);
+	if (table)
+		*max = new_max;
 
-	while (right < q->w - 1 && row[right + 1] == from)
-		right++;
+	return table;
+}
+
+static int component_find(struct quirc_band *b, int c)
+{
+	struct quirc_component *comps = b->components;
 
-	/* Fill the extent */
-	for (i = left; i <= right; i++)
-		row[i] = to;
+	while (comps[c].parent != c) {
+		comps[c].parent = comps[comps[c].parent].parent;
+		c = comps[c].parent;
+	}
+
+	return c;
+}
+
+/* Merge two live components, returning the one which survives. */
+static int component_union(struct quirc_band *band, int a, int b)
+{
+	struct quirc_component *ca;
+	struct quirc_component *cb;
+
+	if (band->components[a].count < band->components[b].count) {
+		int t = a;
+
+		a = b;
+		b = t;
+	}
 
-	/* Return the processed range */
-	*leftp = left;
-	*rightp = right;
+	ca = &band->components[a];
+	cb = &band->components[b];
 
-	if (func)
-		func(user_data, y, left, right);
+	cb->parent = a;
+	ca->count += cb->count;
+	ca->num_runs += cb->num_runs;
+
+	if (cb->seed.y < ca->seed.y ||
+	    (cb->seed.y == ca->seed.y && cb->seed.x < ca->seed.x))
+		ca->seed = cb->seed;
+
+	if (cb->left < ca->left)
+		ca->left = cb->left;
+	if (cb->top < ca->top)
+		ca->top = cb->top;
+	if (cb->right > ca->right)
+		ca->right = cb->right;
+	if (cb->bottom > ca->bottom)
+		ca->bottom = cb->bottom;
+
+	band->runs[ca->tail].next = cb->head;
+	ca->tail = cb->tail;
+
+	return a;
 }
 
-static struct quirc_flood_fill_vars *flood_fill_call_next(
-			struct quirc *q,
-			quirc_pixel_t *row,
-			int from, int to,
-			span_func_t func, void *user_data,
-			struct quirc_flood_fill_vars *vars,
-			int direction)
+/* Attach a newly extracted run to the components of the runs it
+ * touches in the row above, or start a new component. above is the
+ * first run of the row above which might touch it.
+ */
+static void label_run(struct quirc_band *b, int r, int above)
 {
-	int *leftp;
+	struct quirc_run *run = &b->runs[r];
+	const int end = b->row_runs[run->y - b->first_row];
+	struct quirc_component *comp;
+	int c = -1;
+
+	for (; above < end && b->runs[above].left <= run->right; above++) {
+		int other = component_find(b, b->runs[above].component);
+
+		if (c < 0)
+			c = other;
+		else if (other != c)
+			c = component_union(b, c, other);
+	}
 
-	if (direction < 0) {
-		leftp = &vars->left_up;
+	if (c < 0) {
+		c = b->num_components++;
+		comp = &b->components[c];
+
+		comp->parent = c;
+		comp->count = 0;
+		comp->num_runs = 0;
+		comp->seed.x = run->left;
+		comp->seed.y = run->y;
+		comp->left = run->left;
+		comp->top = run->y;
+		comp->right = run->right;
+		comp->bottom = run->y;
+		comp->head = r;
+		comp->region = -1;
 	} else {
-		leftp = &vars->left_down;
-	}
-
-	while (*leftp <= vars->right) {
-		if (row[*leftp] == from) {
-			struct quirc_flood_fill_vars *next_vars;
-			int next_left;
-
-			/* Set up the next context */
-			next_vars = vars + 1;
-			next_vars->y = vars->y + direction;
-
-			/* Fill the extent */
-			flood_fill_line(q,
-					*leftp,
-					next_vars->y,
-					from, to,
-					func, user_data,
-					&next_left,
-					&next_vars->right);
-			next_vars->left_down = next_left;
-			next_vars->left_up = next_left;
-
-			return next_vars;
-		}
-		(*leftp)++;
+		comp = &b->components[c];
+
+		if (run->left < comp->left)
+			comp->left = run->left;
+		if (run->right > comp->right)
+			comp->right = run->right;
+		comp->bottom = run->y;
+		b->runs[comp->tail].next = r;
 	}
-	return NULL;
+
+	run->component = c;
+	run->next = -1;
+	comp->tail = r;
+	comp->count += run->right - run->left + 1;
+	comp->num_runs++;
 }
 
-static void flood_fill_seed(struct quirc *q,
-			    int x0, int y0,
-			    int from, int to,
-			    span_func_t func, void *user_data)
-{
-	struct quirc_flood_fill_vars *const stack = q->flood_fill_vars;
-	const size_t stack_size = q->num_flood_fill_vars;
-	const struct quirc_flood_fill_vars *const last_vars =
-	    &stack[stack_size - 1];
-
-	QUIRC_ASSERT(from != to);
-	QUIRC_ASSERT(q->pixels[y0 * q->w + x0] == from);
-
-	struct quirc_flood_fill_vars *next_vars;
-	int next_left;
-
-	/* Set up the first context  */
-	next_vars = stack;
-	next_vars->y = y0;
-
-	/* Fill the extent */
-	flood_fill_line(q, x0, next_vars->y, from, to,
-			func, user_data,
-			&next_left, &next_vars->right);
-	next_vars->left_down = next_left;
-	next_vars->left_up = next_left;
-
-	while (true) {
-		struct quirc_flood_fill_vars * const vars = next_vars;
-		quirc_pixel_t *row;
-
-		if (vars == last_vars) {
-			/*
-			 * "Stack overflow".
-			 * Just stop and return.
-			 * This can be caused by very complex shapes in
-			 * the image, which is not likely a part of
-			 * a valid QR code anyway.
-			 */
-			break;
-		}
+/* Once the runs of row y and the row above are both in the same band,
+ * join the components which touch across them.
+ */
+static void join_rows(struct quirc_band *b, int y)
+{
+	const int *row_runs = &b->row_runs[y - b->first_row];
+	const int end = row_runs[0];
+	int above = row_runs[-1];
+	int r;
+
+	for (r = row_runs[0]; r < row_runs[1]; r++) {
+		const struct quirc_run *run = &b->runs[r];
+		int c = component_find(b, run->component);
+		int i;
 
-		/* Seed new flood-fills */
-		if (vars->y > 0) {
-			row = q->pixels + (vars->y - 1) * q->w;
+		while (above < end && b->runs[above].right < run->left)
+			above++;
 
-			next_vars = flood_fill_call_next(q, row,
-							 from, to,
-							 func, user_data,
-							 vars, -1);
-			if (next_vars != NULL) {
-				continue;
-			}
+		for (i = above; i < end && b->runs[i].left <= run->right; i++) {
+			int other = component_find(b, b->runs[i].component);
+
+			if (other != c)
+				c = component_union(b, c, other);
 		}
+	}
+}
+
+/* Find the first run in row y which ends at or after x. */
+static int first_run_from(const struct quirc *q, int y, int x)
+{
+	int lo = q->row_runs[y];
+	int hi = q->row_runs[y + 1];
 
-		if (vars->y < q->h - 1) {
-			row = q->pixels + (vars->y + 1) * q->w;
+	while (lo < hi) {
+		int mid = (lo + hi) >> 1;
 
-			next_vars = flood_fill_call_next(q, row,
-							 from, to,
-							 func, user_data,
-							 vars, 1);
-			if (next_vars != NULL) {
-				continue;
-			}
-		}
+		if (q->bands[0].runs[mid].right < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Find the run containing (x, y), or return -1 if the pixel is white. */
+static int run_at(const struct quirc *q, int x, int y)
+{
+	int r = first_run_from(q, y, x);
+
+	if (r < q->row_runs[y + 1] && q->bands[0].runs[r].left <= x)
+		return r;
+
+	return -1;
+}
+
+int quirc_pixel(const struct quirc *q, int x, int y)
+{
+	const struct quirc_component *comps = q->bands[0].components;
+	int r = run_at(q, x, y);
+	int c;
+
+	if (r < 0)
+		return QUIRC_PIXEL_WHITE;
+
+	for (c = q->bands[0].runs[r].component; comps[c].parent != c;
+	     c = comps[c].parent)
+		;
+
+	return comps[c].region >= 0 ? comps[c].region : QUIRC_PIXEL_BLACK;
+}
+
+/* Call func for each run of a region. */
+static void region_spans(const struct quirc *q, int rcode,
+			 span_func_t func, void *user_data)
+{
+	const struct quirc_region *reg = &q->regions[rcode];
+	const struct quirc_span *span = q->spans + reg->first_span;
+	const struct quirc_span *end = span + reg->num_spans;
 
-		if (vars > stack) {
-			/* Restore the previous context */
-			next_vars = vars - 1;
+	for (; span < end; span++)
+		func(user_data, span->y, span->left, span->right);
+}
+
+/************************************************************************
+ * Regions of interest
+ */
+
+static int rect_compare(const void *a, const void *b)
+{
+	const struct quirc_rect *ra = a;
+	const struct quirc_rect *rb = b;
+
+	return (ra->x > rb->x) - (ra->x < rb->x);
+}
+
+/* Sort rectangles into the order roi_span() expects them in. */
+void quirc_sort_rects(struct quirc_rect *rects, int count)
+{
+	qsort(rects, count, sizeof(*rects), rect_compare);
+}
+
+/* Find the next span of row y covered by a region of interest, merging
+ * any which overlap or touch. Everything is measured in units of
+ * 1 << shift pixels of the image being scanned, and each region is
+ * first grown by margin units on every side. In a decimated image, only
+ * the pixels made wholly from pixels inside a region are covered by it.
+ * *next is the index of the first region yet to be looked at, and
+ * should start at zero. Returns 0 when there are no more spans.
+ */
+static int roi_span(const struct quirc *q, int y, int shift, int margin,
+		    int *next, int *left, int *right)
+{
+	const int last_x = (q->w - 1) >> shift;
+	const int last_y = (q->h - 1) >> shift;
+	int found = 0;
+
+	while (*next < q->num_rois) {
+		const struct quirc_rect *r = &q->rois[*next];
+		const int round = (1 << q->level) - 1;
+		int x0 = (r->x + round) >> q->level;
+		int x1 = ((r->x + r->w) >> q->level) - 1;
+		int y0 = (r->y + round) >> q->level;
+		int y1 = ((r->y + r->h) >> q->level) - 1;
+
+		if (x0 < 0)
+			x0 = 0;
+		if (x1 >= q->w)
+			x1 = q->w - 1;
+		if (y0 < 0)
+			y0 = 0;
+		if (y1 >= q->h)
+			y1 = q->h - 1;
+
+		x0 = (x0 >> shift) - margin;
+		x1 = (x1 >> shift) + margin;
+		y0 = (y0 >> shift) - margin;
+		y1 = (y1 >> shift) + margin;
+
+		if (x0 < 0)
+			x0 = 0;
+		if (x1 > last_x)
+			x1 = last_x;
+
+		if (x1 < x0 || y < y0 || y > y1 || y > last_y) {
+			(*next)++;
 			continue;
 		}
 
-		/* We've done. */
-		break;
+		/* Regions are sorted by their left edges, so the span
+		 * ends at the first one which starts past it.
+		 */
+		if (found && x0 > *right + 1)
+			break;
+
+		if (!found) {
+			*left = x0;
+			*right = x1;
+			found = 1;
+		} else if (x1 > *right) {
+			*right = x1;
+		}
+
+		(*next)++;
 	}
+
+	return found;
 }
 
-/************************************************************************
- * Adaptive thresholding
+/* Add up the histogram of every step-th row starting from first, or of
+ * the parts of those rows inside the regions of interest. Returns the
+ * number of pixels counted.
  */
-
-static uint8_t otsu(const struct quirc *q)
+static unsigned int sample_histogram(const struct quirc *q, int first,
+				     int step, unsigned int *histogram)
 {
-	unsigned int numPixels = q->w * q->h;
+	unsigned int count = 0;
+	int y;
 
-	// Calculate histogram
-	unsigned int histogram[UINT8_MAX + 1];
-	(void)memset(histogram, 0, sizeof(histogram));
-	uint8_t* ptr = q->image;
-	unsigned int length = numPixels;
-	while (length--) {
-		uint8_t value = *ptr++;
-		histogram[value]++;
+	memset(histogram, 0, sizeof(histogram[0]) * (UINT8_MAX + 1));
+
+	if (!q->num_rois) {
+		const int rows = first < q->h ?
+			(q->h - first + step - 1) / step : 0;
+
+		quirc_histogram(q->image + (size_t)first * q->w, q->w, rows,
+				(size_t)step * q->w, histogram);
+		return (unsigned int)rows * q->w;
+	}
+
+	for (y = first; y < q->h; y += step) {
+		const uint8_t *row = q->image + (size_t)y * q->w;
+		int next = 0;
+		int left, right;
+
+		while (roi_span(q, y, 0, 0, &next, &left, &right)) {
+			quirc_histogram(row + left, right - left + 1, 1, 0,
+					histogram);
+			count += right - left + 1;
+		}
 	}
 
+	return count;
+}
+
+/************************************************************************
+ * Global thresholding
+ */
+
+static uint8_t otsu(const unsigned int *histogram, unsigned int numPixels)
+{
 	// Calculate weighted sum of histogram values
 	quirc_float_t sum = (quirc_float_t)0;
 	unsigned int i = 0;
@@ -339,312 +527,599 @@ static uint8_t otsu(const struct quirc *q)
 	return threshold;
 }
 
-static void area_count(void *user_data, int y, int left, int right)
+static uint8_t global_threshold(const struct quirc *q)
 {
-	((struct quirc_region *)user_data)->count += right - left + 1;
-}
+	unsigned int numPixels = q->w * q->h;
 
-static int region_code(struct quirc *q, int x, int y)
-{
-	int pixel;
-	struct quirc_region *box;
-	int region;
+	// Calculate histogram
+	unsigned int histogram[UINT8_MAX + 1];
+	if (q->num_rois) {
+		numPixels = sample_histogram(q, 0, 1, histogram);
+	} else {
+		memset(histogram, 0, sizeof(histogram));
+		quirc_histogram(q->image, numPixels, 1, 0, histogram);
+	}
 
-	if (x < 0 || y < 0 || x >= q->w || y >= q->h)
-		return -1;
+	return otsu(histogram, numPixels);
+}
 
-	pixel = q->pixels[y * q->w + x];
+/* In video mode, the threshold is estimated from a sample of the rows of
+ * each frame and smoothed over successive frames. The full histogram is
+ * only computed for the first frame, or when the estimate moves too far
+ * from the current threshold (a scene or exposure change).
+ */
+static uint8_t video_threshold(struct quirc *q)
+{
+	unsigned int histogram[UINT8_MAX + 1];
+	unsigned int numPixels;
+	int estimate;
+	int current;
 
-	if (pixel >= QUIRC_PIXEL_REGION)
-		return pixel;
+	if (q->video_level < 0) {
+		q->video_level = global_threshold(q) << QUIRC_VIDEO_LEVEL_SHIFT;
+		return q->video_level >> QUIRC_VIDEO_LEVEL_SHIFT;
+	}
 
-	if (pixel == QUIRC_PIXEL_WHITE)
-		return -1;
+	numPixels = sample_histogram(q, QUIRC_VIDEO_ROW_STRIDE / 2,
+				     QUIRC_VIDEO_ROW_STRIDE, histogram);
 
-	if (q->num_regions >= QUIRC_MAX_REGIONS)
-		return -1;
+	estimate = otsu(histogram, numPixels);
+	current = q->video_level >> QUIRC_VIDEO_LEVEL_SHIFT;
 
-	region = q->num_regions;
-	box = &q->regions[q->num_regions++];
+	if (abs(estimate - current) > QUIRC_VIDEO_MAX_DRIFT) {
+		q->video_level = global_threshold(q) << QUIRC_VIDEO_LEVEL_SHIFT;
+	} else {
+		/* Exponential moving average, with a weight of 1/4 on
+		 * the new estimate.
+		 */
+		q->video_level += ((estimate << QUIRC_VIDEO_LEVEL_SHIFT) -
+				   q->video_level) / 4;
+	}
 
-	memset(box, 0, sizeof(*box));
+	return (q->video_level + (1 << (QUIRC_VIDEO_LEVEL_SHIFT - 1))) >>
+		QUIRC_VIDEO_LEVEL_SHIFT;
+}
 
-	box->seed.x = x;
-	box->seed.y = y;
-	box->capstone = -1;
+/************************************************************************
+ * Adaptive thresholding
+ */
 
-	flood_fill_seed(q, x, y, pixel, region, area_count, box);
+/* Half the width, in blocks, of the window each threshold is taken
+ * over, not counting the block itself.
+ */
+static int adaptive_radius(const struct quirc *q)
+{
+	int size = (q->w > q->h ? q->w : q->h) >> 3;
+	int radius = size >> (QUIRC_THRESHOLD_BLOCK_SHIFT + 1);
 
-	return region;
+	return radius < 1 ? 1 : radius;
 }
 
-struct polygon_score_data {
-	struct quirc_point	ref;
-
-	int			scores[4];
-	struct quirc_point	*corners;
-};
-
-static void find_one_corner(void *user_data, int y, int left, int right)
+/* Add the pixels of row from left to right inclusive to the block
+ * sums. A span starting part way through a block has its first pixels
+ * summed on their own, as the kernels start a new block at the first
+ * pixel they're given.
+ */
+static void span_sums(const struct quirc *q, const uint8_t *row,
+		      int left, int right, struct quirc_block_sum *acc)
 {
-	struct polygon_score_data *psd =
-		(struct polygon_score_data *)user_data;
-	int xs[2] = {left, right};
-	int dy = y - psd->ref.y;
-	int i;
+	const int head = -left & (QUIRC_THRESHOLD_BLOCK - 1);
+	int bx = left >> QUIRC_THRESHOLD_BLOCK_SHIFT;
 
-	for (i = 0; i < 2; i++) {
-		int dx = xs[i] - psd->ref.x;
-		int d = dx * dx + dy * dy;
+	if (head) {
+		const int n = head < right - left + 1 ?
+			head : right - left + 1;
 
-		if (d > psd->scores[0]) {
-			psd->scores[0] = d;
-			psd->corners[0].x = xs[i];
-			psd->corners[0].y = y;
-		}
+		q->kernels.block_sums(row + left, n, acc + bx);
+		left += n;
+		bx++;
 	}
+
+	if (left <= right)
+		q->kernels.block_sums(row + left, right - left + 1, acc + bx);
 }
 
-static void find_other_corners(void *user_data, int y, int left, int right)
+/* Build the summed-area table of per-block pixel sums, counts and sums
+ * of squares for adaptive thresholding.
+ *
+ * With regions of interest, only the pixels inside them are summed, and
+ * windows reaching past their edges take the mean of the pixels which
+ * are. Thresholds near the edges can then differ from those of a scan
+ * of the whole image.
+ */
+static void integral_setup(struct quirc *q)
 {
-	struct polygon_score_data *psd =
-		(struct polygon_score_data *)user_data;
-	int xs[2] = {left, right};
-	int i;
-
-	for (i = 0; i < 2; i++) {
-		int up = xs[i] * psd->ref.x + y * psd->ref.y;
-		int right = xs[i] * -psd->ref.y + y * psd->ref.x;
-		int scores[4] = {up, right, -up, -right};
-		int j;
-
-		for (j = 0; j < 4; j++) {
-			if (scores[j] > psd->scores[j]) {
-				psd->scores[j] = scores[j];
-				psd->corners[j].x = xs[i];
-				psd->corners[j].y = y;
+	const int bw = (q->w + QUIRC_THRESHOLD_BLOCK - 1) >>
+		QUIRC_THRESHOLD_BLOCK_SHIFT;
+	const int bh = (q->h + QUIRC_THRESHOLD_BLOCK - 1) >>
+		QUIRC_THRESHOLD_BLOCK_SHIFT;
+	const int stride = bw + 1;
+	int by, bx;
+
+	memset(q->integral, 0, sizeof(q->integral[0]) * stride);
+
+	for (by = 0; by < bh; by++) {
+		const struct quirc_block_sum *prev = q->integral + by * stride;
+		struct quirc_block_sum *cur = q->integral + (by + 1) * stride;
+		int y = by << QUIRC_THRESHOLD_BLOCK_SHIFT;
+		int y1 = y + QUIRC_THRESHOLD_BLOCK;
+		uint32_t acc = 0;
+		uint32_t acc_count = 0;
+		uint64_t acc_sq = 0;
+
+		if (y1 > q->h)
+			y1 = q->h;
+
+		memset(cur, 0, sizeof(cur[0]) * stride);
+		if (!q->num_rois) {
+			for (; y < y1; y++)
+				q->kernels.block_sums(q->image + y * q->w,
+						      q->w, cur + 1);
+		} else {
+			for (; y < y1; y++) {
+				const uint8_t *row = q->image + y * q->w;
+				int next = 0;
+				int left, right;
+
+				while (roi_span(q, y, 0, 0, &next,
+						&left, &right))
+					span_sums(q, row, left, right,
+						  cur + 1);
 			}
 		}
+
+		for (bx = 0; bx < bw; bx++) {
+			acc += cur[bx + 1].sum;
+			acc_count += cur[bx + 1].count;
+			acc_sq += cur[bx + 1].sum_sq;
+			cur[bx + 1].sum = acc + prev[bx + 1].sum;
+			cur[bx + 1].count = acc_count + prev[bx + 1].count;
+			cur[bx + 1].sum_sq = acc_sq + prev[bx + 1].sum_sq;
+		}
 	}
 }
 
-static void find_region_corners(struct quirc *q,
-				int rcode, const struct quirc_point *ref,
-				struct quirc_point *corners)
+/* Find the threshold for one block, from the mean and the standard
+ * deviation of the window of blocks around it.
+ *
+ * Bradley's method takes a fixed share of the mean as the bias, which
+ * keeps noise on flat areas white. On a dense code of low contrast,
+ * though, that can be more than the margin by which blurred, isolated
+ * dark modules fall below the mean. Where the window isn't flat, the
+ * bias follows the contrast instead.
+ */
+static uint8_t adaptive_block(const struct quirc *q, int bx, int by)
 {
-	struct quirc_region *region = &q->regions[rcode];
-	struct polygon_score_data psd;
-	int i;
+	const int bw = (q->w + QUIRC_THRESHOLD_BLOCK - 1) >>
+		QUIRC_THRESHOLD_BLOCK_SHIFT;
+	const int bh = (q->h + QUIRC_THRESHOLD_BLOCK - 1) >>
+		QUIRC_THRESHOLD_BLOCK_SHIFT;
+	const int stride = bw + 1;
+	const int radius = adaptive_radius(q);
+	const struct quirc_block_sum *t00, *t01, *t10, *t11;
+	int x0 = bx - radius;
+	int x1 = bx + radius + 1;
+	int y0 = by - radius;
+	int y1 = by + radius + 1;
+	quirc_float_t count, mean, var, sd;
+	quirc_float_t bradley, faded, bias;
+	int t;
+
+	if (x0 < 0)
+		x0 = 0;
+	if (x1 > bw)
+		x1 = bw;
+	if (y0 < 0)
+		y0 = 0;
+	if (y1 > bh)
+		y1 = bh;
+
+	t00 = &q->integral[y0 * stride + x0];
+	t01 = &q->integral[y0 * stride + x1];
+	t10 = &q->integral[y1 * stride + x0];
+	t11 = &q->integral[y1 * stride + x1];
+
+	/* Outside the regions of interest, where nothing was summed,
+	 * nothing is black.
+	 */
+	count = (uint32_t)(t11->count - t01->count - t10->count +
+			   t00->count);
+	if (!count)
+		return 0;
 
-	memset(&psd, 0, sizeof(psd));
-	psd.corners = corners;
+	mean = (uint32_t)(t11->sum - t01->sum - t10->sum + t00->sum) /
+		count;
+	var = (t11->sum_sq - t01->sum_sq - t10->sum_sq + t00->sum_sq) /
+		count - mean * mean;
 
-	memcpy(&psd.ref, ref, sizeof(psd.ref));
-	psd.scores[0] = -1;
-	flood_fill_seed(q, region->seed.x, region->seed.y,
-			rcode, QUIRC_PIXEL_BLACK,
-			find_one_corner, &psd);
+	/* The larger of a quarter of the standard deviation and Bradley's
+	 * bias, faded out as the standard deviation rises to
+	 * QUIRC_ADAPTIVE_CONTRAST. Neither may exceed Bradley's bias.
+	 */
+	bradley = mean * QUIRC_ADAPTIVE_BIAS / 100;
+	sd = var > 0 ? sqrt(var) : 0;
+	faded = bradley * (1 - sd / QUIRC_ADAPTIVE_CONTRAST);
+	bias = sd / 4 > faded ? sd / 4 : faded;
+	if (bias > bradley)
+		bias = bradley;
+
+	/* A pixel is black if it is no brighter than mean - bias, i.e.
+	 * if it is less than t.
+	 */
+	t = (int)(mean - bias) + 1;
+	if (t > UINT8_MAX)
+		t = UINT8_MAX;
 
-	psd.ref.x = psd.corners[0].x - psd.ref.x;
-	psd.ref.y = psd.corners[0].y - psd.ref.y;
+	return (uint8_t)t;
+}
 
-	for (i = 0; i < 4; i++)
-		memcpy(&psd.corners[i], &region->seed,
-		       sizeof(psd.corners[i]));
+/* Fill in the threshold row for one row of blocks. */
+static void adaptive_row(const struct quirc *q, uint8_t *row, int by)
+{
+	int left;
 
-	i = region->seed.x * psd.ref.x + region->seed.y * psd.ref.y;
-	psd.scores[0] = i;
-	psd.scores[2] = -i;
-	i = region->seed.x * -psd.ref.y + region->seed.y * psd.ref.x;
-	psd.scores[1] = i;
-	psd.scores[3] = -i;
+	for (left = 0; left < q->w; left += QUIRC_THRESHOLD_BLOCK) {
+		const int len = q->w - left < QUIRC_THRESHOLD_BLOCK ?
+			q->w - left : QUIRC_THRESHOLD_BLOCK;
 
-	flood_fill_seed(q, region->seed.x, region->seed.y,
-			QUIRC_PIXEL_BLACK, rcode,
-			find_other_corners, &psd);
+		memset(row + left,
+		       adaptive_block(q, left >> QUIRC_THRESHOLD_BLOCK_SHIFT,
+				      by),
+		       len);
+	}
 }
 
-static void record_capstone(struct quirc *q, int ring, int stone)
+/* Adaptive thresholding applies unless the image is already binary, or
+ * the caller has supplied a threshold of their own.
+ */
+static int adaptive_threshold(const struct quirc *q)
 {
-	struct quirc_region *stone_reg = &q->regions[stone];
-	struct quirc_region *ring_reg = &q->regions[ring];
-	struct quirc_capstone *capstone;
-	int cs_index;
+	return q->threshold_mode == QUIRC_THRESHOLD_ADAPTIVE &&
+	       !q->binary && !q->fixed_threshold;
+}
 
-	if (q->num_capstones >= QUIRC_MAX_CAPSTONES)
+/* Prepare to threshold the image: either choose the global threshold,
+ * or build the block sums for adaptive thresholding.
+ */
+static void threshold_setup(struct quirc *q)
+{
+	if (q->binary)
 		return;
 
-	cs_index = q->num_capstones;
-	capstone = &q->capstones[q->num_capstones++];
-
-	memset(capstone, 0, sizeof(*capstone));
+	if (adaptive_threshold(q))
+		integral_setup(q);
+	else if (q->video_mode && q->w && q->h)
+		memset(q->threshold_row, video_threshold(q), q->w);
+	else if (q->w)
+		memset(q->threshold_row, global_threshold(q), q->w);
+}
 
-	capstone->qr_grid = -1;
-	capstone->ring = ring;
-	capstone->stone = stone;
-	stone_reg->capstone = cs_index;
-	ring_reg->capstone = cs_index;
+/* Index of the lowest set bit of a non-zero word. */
+static inline int lowest_bit(uint64_t word)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(word);
+#else
+	int i = 0;
 
-	/* Find the corners of the ring */
-	find_region_corners(q, ring, &stone_reg->seed, capstone->corners);
+	if (!(word & 0xffffffff)) {
+		word >>= 32;
+		i += 32;
+	}
+	if (!(word & 0xffff)) {
+		word >>= 16;
+		i += 16;
+	}
+	if (!(word & 0xff)) {
+		word >>= 8;
+		i += 8;
+	}
+	while (!(word & 1)) {
+		word >>= 1;
+		i++;
+	}
 
-	/* Set up the perspective transform and find the center */
-	perspective_setup(capstone->c, capstone->corners, 7.0, 7.0);
-	perspective_map(capstone->c, 3.5, 3.5, &capstone->center);
+	return i;
+#endif
 }
 
-static void test_capstone(struct quirc *q, unsigned int x, unsigned int y,
-			  unsigned int *pb)
+static void add_run(struct quirc_band *b, int y, int left, int right,
+		    int *above)
 {
-	int ring_right = region_code(q, x - pb[4], y);
-	int stone = region_code(q, x - pb[4] - pb[3] - pb[2], y);
-	int ring_left = region_code(q, x - pb[4] - pb[3] -
-				    pb[2] - pb[1] - pb[0],
-				    y);
-	struct quirc_region *stone_reg;
-	struct quirc_region *ring_reg;
-	unsigned int ratio;
+	const int r = b->num_runs++;
+	const int end = b->row_runs[y - b->first_row];
+	struct quirc_run *run = &b->runs[r];
 
-	if (ring_left < 0 || ring_right < 0 || stone < 0)
-		return;
+	run->left = left;
+	run->right = right;
+	run->y = y;
 
-	/* Left and ring of ring should be connected */
-	if (ring_left != ring_right)
-		return;
+	while (*above < end && b->runs[*above].right < left)
+		(*above)++;
 
-	/* Ring should be disconnected from stone */
-	if (ring_left == stone)
-		return;
+	label_run(b, r, *above);
+}
 
-	stone_reg = &q->regions[stone];
-	ring_reg = &q->regions[ring_left];
+/* Append the black runs of a thresholded row to the run lists, and
+ * label them. If the tables can't be grown, the row is left without any
+ * runs.
+ *
+ * Runs are found a word at a time: XORing each word with itself shifted
+ * left by one pixel leaves a bit set wherever the colour changes, and
+ * those are picked off lowest first. Words of a single colour cost one
+ * comparison.
+ */
+static void extract_runs(const struct quirc *q, struct quirc_band *b, int y)
+{
+	const uint64_t *row = q->bits + (size_t)y * q->stride;
+	const int most = (q->w + 1) / 2;
+	int *row_runs = &b->row_runs[y - b->first_row];
+	struct quirc_component *comps;
+	struct quirc_run *runs;
+	int above = y > b->first_row ? row_runs[-1] : 0;
+	uint64_t carry = 0;
+	int left = -1;
+	int i;
 
-	/* Already detected */
-	if (stone_reg->capstone >= 0 || ring_reg->capstone >= 0)
-		return;
+	runs = table_reserve(b->runs, &b->max_runs, b->num_runs, most,
+			     sizeof(*runs));
+	if (runs)
+		b->runs = runs;
 
-	/* Ratio should ideally be 37.5 */
-	ratio = stone_reg->count * 100 / ring_reg->count;
-	if (ratio < 10 || ratio > 70)
+	comps = table_reserve(b->components, &b->max_components,
+			      b->num_components, most, sizeof(*comps));
+	if (comps)
+		b->components = comps;
+
+	if (!runs || !comps) {
+		row_runs[1] = b->num_runs;
 		return;
+	}
 
-	record_capstone(q, ring_left, stone);
-}
+	for (i = 0; i < q->stride; i++) {
+		const uint64_t word = row[i];
+		uint64_t edges = word ^ ((word << 1) | carry);
 
-static void finder_scan(struct quirc *q, unsigned int y)
-{
-	quirc_pixel_t *row = q->pixels + y * q->w;
-	unsigned int x;
-	int last_color = 0;
-	unsigned int run_length = 0;
-	unsigned int run_count = 0;
-	unsigned int pb[5];
+		carry = word >> 63;
+
+		while (edges) {
+			const int x = (i << 6) + lowest_bit(edges);
+
+			edges &= edges - 1;
 
-	memset(pb, 0, sizeof(pb));
-	for (x = 0; x < q->w; x++) {
-		int color = row[x] ? 1 : 0;
-
-		if (x && color != last_color) {
-			memmove(pb, pb + 1, sizeof(pb[0]) * 4);
-			pb[4] = run_length;
-			run_length = 0;
-			run_count++;
-
-			if (!color && run_count >= 5) {
-				const int scale = 16;
-				static const unsigned int check[5] = {1, 1, 3, 1, 1};
-				unsigned int avg, err;
-				unsigned int i;
-				int ok = 1;
-
-				avg = (pb[0] + pb[1] + pb[3] + pb[4]) * scale / 4;
-				err = avg * 3 / 4;
-
-				for (i = 0; i < 5; i++)
-					if (pb[i] * scale < check[i] * avg - err ||
-					    pb[i] * scale > check[i] * avg + err)
-						ok = 0;
-
-				if (ok)
-					test_capstone(q, x, y, pb);
+			if (left < 0) {
+				left = x;
+			} else {
+				add_run(b, y, left, x - 1, &above);
+				left = -1;
 			}
 		}
+	}
+
+	/* A run reaching the right edge has no closing transition */
+	if (left >= 0)
+		add_run(b, y, left, q->w - 1, &above);
+
+	row_runs[1] = b->num_runs;
+}
 
-		run_length++;
-		last_color = color;
+/* Threshold the pixels of row y from left to right inclusive into the
+ * bit plane, leaving the other bits of the row as they were.
+ */
+static void binarize_span(const struct quirc *q, const uint8_t *threshold,
+			  int y, int left, int right)
+{
+	uint64_t *dst = q->bits + (size_t)y * q->stride;
+	const uint8_t *src = q->image + (size_t)y * q->w;
+	/* Binary images are thresholded at 1, which marks white pixels
+	 * rather than black ones.
+	 */
+	const uint64_t invert = q->binary ? ~(uint64_t)0 : 0;
+	const int w1 = right >> 6;
+	const uint64_t last = dst[w1];
+	const uint64_t hi = ~(uint64_t)0 >> (63 - (right & 63));
+	int w0 = left >> 6;
+	int i;
+
+	/* A span starting part way through a word is thresholded into a
+	 * word of its own first, so that no pixel left of it is read.
+	 */
+	if (left & 63) {
+		const int shift = left & 63;
+		const int n = right - left < 63 - shift ?
+			right - left + 1 : 64 - shift;
+		const uint64_t mask = (((uint64_t)1 << n) - 1) << shift;
+		uint64_t word;
+
+		q->kernels.binarize(src + left, threshold + left, &word, n);
+		dst[w0] = (dst[w0] & ~mask) | (((word ^ invert) << shift) &
+					       mask);
+		if (++w0 > w1)
+			return;
 	}
+
+	q->kernels.binarize(src + (w0 << 6), threshold + (w0 << 6),
+			    dst + w0, right + 1 - (w0 << 6));
+
+	for (i = w0; i <= w1; i++)
+		dst[i] ^= invert;
+
+	dst[w1] = (last & ~hi) | (dst[w1] & hi);
 }
 
-static void find_alignment_pattern(struct quirc *q, int index)
+/* Threshold row y into the bit plane. With regions of interest, only
+ * the parts of the row inside them are thresholded and the rest is left
+ * white. Returns 0 if the row lies outside them all.
+ */
+static int binarize_row(const struct quirc *q, const uint8_t *threshold,
+			int y)
 {
-	struct quirc_grid *qr = &q->grids[index];
-	struct quirc_capstone *c0 = &q->capstones[qr->caps[0]];
-	struct quirc_capstone *c2 = &q->capstones[qr->caps[2]];
-	struct quirc_point a;
-	struct quirc_point b;
-	struct quirc_point c;
-	int size_estimate;
-	int step_size = 1;
-	int dir = 0;
-	quirc_float_t u, v;
+	int next = 0;
+	int left, right;
+	int found = 0;
+
+	if (!q->num_rois) {
+		if (q->w)
+			binarize_span(q, threshold, y, 0, q->w - 1);
+		return 1;
+	}
 
-	/* Grab our previous estimate of the alignment pattern corner */
-	memcpy(&b, &qr->align, sizeof(b));
+	memset(q->bits + (size_t)y * q->stride, 0,
+	       sizeof(q->bits[0]) * q->stride);
 
-	/* Guess another two corners of the alignment pattern so that we
-	 * can estimate its size.
-	 */
-	perspective_unmap(c0->c, &b, &u, &v);
-	perspective_map(c0->c, u, v + (quirc_float_t)1.0, &a);
-	perspective_unmap(c2->c, &b, &u, &v);
-	perspective_map(c2->c, u + (quirc_float_t)1.0, v, &c);
+	while (roi_span(q, y, 0, 0, &next, &left, &right)) {
+		binarize_span(q, threshold, y, left, right);
+		found = 1;
+	}
 
-	size_estimate = abs((a.x - b.x) * -(c.y - b.y) +
-			    (a.y - b.y) * (c.x - b.x));
+	return found;
+}
 
-	/* Spiral outwards from the estimate point until we find something
-	 * roughly the right size. Don't look too far from the estimate
-	 * point.
-	 */
-	while (step_size * step_size < size_estimate * 100) {
-		static const int dx_map[] = {1, 0, -1, 0};
-		static const int dy_map[] = {0, -1, 0, 1};
-		int i;
+/* Threshold a row of a band and extract its runs. Rows outside the
+ * regions of interest get no runs at all.
+ */
+static void threshold_row(const struct quirc *q, struct quirc_band *b, int y)
+{
+	const uint8_t *threshold = q->threshold_row;
 
-		for (i = 0; i < step_size; i++) {
-			int code = region_code(q, b.x, b.y);
+	if (adaptive_threshold(q)) {
+		if (!(y & (QUIRC_THRESHOLD_BLOCK - 1)))
+			adaptive_row(q, b->threshold_row,
+				     y >> QUIRC_THRESHOLD_BLOCK_SHIFT);
+		threshold = b->threshold_row;
+	}
 
-			if (code >= 0) {
-				struct quirc_region *reg = &q->regions[code];
+	if (!binarize_row(q, threshold, y)) {
+		b->row_runs[y - b->first_row + 1] = b->num_runs;
+		return;
+	}
 
-				if (reg->count >= size_estimate / 2 &&
-				    reg->count <= size_estimate * 2) {
-					qr->align_region = code;
-					return;
-				}
-			}
+	extract_runs(q, b, y);
+}
 
-			b.x += dx_map[dir];
-			b.y += dy_map[dir];
-		}
+static int span_compare(const void *a, const void *b)
+{
+	const struct quirc_span *sa = (const struct quirc_span *)a;
+	const struct quirc_span *sb = (const struct quirc_span *)b;
 
-		dir = (dir + 1) % 4;
-		if (!(dir & 1))
-			step_size++;
+	if (sa->y != sb->y)
+		return sa->y < sb->y ? -1 : 1;
+
+	return (sa->left > sb->left) - (sa->left < sb->left);
+}
+
+static int region_code(struct quirc *q, int x, int y)
+{
+	struct quirc_component *comp;
+	struct quirc_region *box;
+	struct quirc_span *spans;
+	int64_t sx = 0, sy = 0, sxx = 0, syy = 0;
+	int region;
+	int r;
+	int c;
+
+	if (x < 0 || y < 0 || x >= q->w || y >= q->h)
+		return -1;
+
+	r = run_at(q, x, y);
+	if (r < 0)
+		return -1;
+
+	c = component_find(q->bands, q->bands[0].runs[r].component);
+	comp = &q->bands[0].components[c];
+
+	if (comp->region >= 0)
+		return comp->region;
+
+	if (q->num_regions - QUIRC_PIXEL_REGION >= q->region_limit)
+		return -1;
+
+	box = table_reserve(q->regions, &q->max_regions, q->num_regions, 1,
+			    sizeof(*box));
+	if (!box)
+		return -1;
+	q->regions = box;
+
+	/* Copy the runs into the span arena, so that the corner searches
+	 * can walk them without chasing the run list.
+	 */
+	spans = table_reserve(q->spans, &q->max_spans, q->num_spans,
+			      comp->num_runs, sizeof(*spans));
+	if (!spans)
+		return -1;
+	q->spans = spans;
+
+	region = q->num_regions;
+	box = &q->regions[q->num_regions++];
+
+	box->seed.x = x;
+	box->seed.y = y;
+	box->count = comp->count;
+	box->capstone = -1;
+	box->component = c;
+	box->first_span = q->num_spans;
+	box->num_spans = 0;
+	box->left = comp->left;
+	box->top = comp->top;
+	box->right = comp->right;
+	box->bottom = comp->bottom;
+
+	for (r = comp->head; r >= 0; r = q->bands[0].runs[r].next) {
+		const struct quirc_run *run = &q->bands[0].runs[r];
+		struct quirc_span *span = &spans[q->num_spans++];
+		const int64_t n = run->right - run->left + 1;
+		const int64_t x = n * (run->left + run->right) / 2;
+		const int64_t l = run->left - 1;
+		const int64_t rt = run->right;
+
+		span->y = run->y;
+		span->left = run->left;
+		span->right = run->right;
+		box->num_spans++;
+
+		sx += x;
+		sy += n * run->y;
+		sxx += (rt * (rt + 1) * (2 * rt + 1) -
+			l * (l + 1) * (2 * l + 1)) / 6;
+		syy += n * run->y * run->y;
 	}
+
+	/* Put the spans in raster order, so that ties in the corner
+	 * searches don't depend on the order components were merged in.
+	 */
+	qsort(spans + box->first_span, box->num_spans, sizeof(*spans),
+	      span_compare);
+
+	box->cx = (quirc_float_t)sx / comp->count;
+	box->cy = (quirc_float_t)sy / comp->count;
+	box->mu20 = (quirc_float_t)sxx / comp->count - box->cx * box->cx;
+	box->mu02 = (quirc_float_t)syy / comp->count - box->cy * box->cy;
+
+	comp->region = region;
+
+	return region;
 }
 
-static void find_leftmost_to_line(void *user_data, int y, int left, int right)
+struct polygon_score_data {
+	struct quirc_point	ref;
+
+	int			scores[4];
+	struct quirc_point	*corners;
+};
+
+static void find_one_corner(void *user_data, int y, int left, int right)
 {
 	struct polygon_score_data *psd =
 		(struct polygon_score_data *)user_data;
 	int xs[2] = {left, right};
+	int dy = y - psd->ref.y;
 	int i;
 
 	for (i = 0; i < 2; i++) {
-		int d = -psd->ref.y * xs[i] + psd->ref.x * y;
+		int dx = xs[i] - psd->ref.x;
+		int d = dx * dx + dy * dy;
 
-		if (d < psd->scores[0]) {
+		if (d > psd->scores[0]) {
 			psd->scores[0] = d;
 			psd->corners[0].x = xs[i];
 			psd->corners[0].y = y;
@@ -652,475 +1127,2919 @@ static void find_leftmost_to_line(void *user_data, int y, int left, int right)
 	}
 }
 
-static quirc_float_t length(struct quirc_point a, struct quirc_point b)
+static void find_other_corners(void *user_data, int y, int left, int right)
 {
-	quirc_float_t x = abs(a.x - b.x) + 1;
-	quirc_float_t y = abs(a.y - b.y) + 1;
-	return sqrt(x * x +  y * y);
+	struct polygon_score_data *psd =
+		(struct polygon_score_data *)user_data;
+	int xs[2] = {left, right};
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		int up = xs[i] * psd->ref.x + y * psd->ref.y;
+		int right = xs[i] * -psd->ref.y + y * psd->ref.x;
+		int scores[4] = {up, right, -up, -right};
+		int j;
+
+		for (j = 0; j < 4; j++) {
+			if (scores[j] > psd->scores[j]) {
+				psd->scores[j] = scores[j];
+				psd->corners[j].x = xs[i];
+				psd->corners[j].y = y;
+			}
+		}
+	}
 }
-/* Estimate grid size by determing distance between capstones
- */
-static void measure_grid_size(struct quirc *q, int index)
+
+static void find_region_corners(struct quirc *q,
+				int rcode, const struct quirc_point *ref,
+				struct quirc_point *corners)
 {
-	struct quirc_grid *qr = &q->grids[index];
+	struct quirc_region *region = &q->regions[rcode];
+	struct polygon_score_data psd;
+	int i;
 
-	struct quirc_capstone *a = &(q->capstones[qr->caps[0]]);
-	struct quirc_capstone *b = &(q->capstones[qr->caps[1]]);
-	struct quirc_capstone *c = &(q->capstones[qr->caps[2]]);
+	memset(&psd, 0, sizeof(psd));
+	psd.corners = corners;
 
-	quirc_float_t ab = length(b->corners[0], a->corners[3]);
-	quirc_float_t capstone_ab_size = (length(b->corners[0], b->corners[3]) + length(a->corners[0], a->corners[3]))/2.0;
-	quirc_float_t ver_grid = (quirc_float_t)7.0 * ab / capstone_ab_size;
+	memcpy(&psd.ref, ref, sizeof(psd.ref));
+	psd.scores[0] = -1;
+	region_spans(q, rcode, find_one_corner, &psd);
 
-	quirc_float_t bc = length(b->corners[0], c->corners[1]);
-	quirc_float_t capstone_bc_size = (length(b->corners[0], b->corners[1]) + length(c->corners[0], c->corners[1]))/2.0;
-	quirc_float_t hor_grid = (quirc_float_t)7.0 * bc / capstone_bc_size;
+	psd.ref.x = psd.corners[0].x - psd.ref.x;
+	psd.ref.y = psd.corners[0].y - psd.ref.y;
 
-	quirc_float_t grid_size_estimate = (ver_grid + hor_grid) * (quirc_float_t)(0.5);
+	for (i = 0; i < 4; i++)
+		memcpy(&psd.corners[i], &region->seed,
+		       sizeof(psd.corners[i]));
 
-	int ver = (int)((grid_size_estimate - (quirc_float_t)(17.0 - 2.0)) * (quirc_float_t)(1./4));
+	i = region->seed.x * psd.ref.x + region->seed.y * psd.ref.y;
+	psd.scores[0] = i;
+	psd.scores[2] = -i;
+	i = region->seed.x * -psd.ref.y + region->seed.y * psd.ref.x;
+	psd.scores[1] = i;
+	psd.scores[3] = -i;
 
-	qr->grid_size =  4*ver + 17;
+	region_spans(q, rcode, find_other_corners, &psd);
+}
+
+static void record_capstone(struct quirc *q, int ring, int stone)
+{
+	struct quirc_region *stone_reg = &q->regions[stone];
+	struct quirc_region *ring_reg = &q->regions[ring];
+	struct quirc_capstone *capstone;
+	int cs_index;
+
+	if (q->num_capstones >= q->capstone_limit)
+		return;
+
+	capstone = table_reserve(q->capstones, &q->max_capstones,
+				 q->num_capstones, 1, sizeof(*capstone));
+	if (!capstone)
+		return;
+	q->capstones = capstone;
+
+	cs_index = q->num_capstones;
+	capstone = &q->capstones[q->num_capstones++];
+
+	memset(capstone, 0, sizeof(*capstone));
+
+	capstone->qr_grid = -1;
+	capstone->ring = ring;
+	capstone->stone = stone;
+	capstone->center.x = (int)(ring_reg->cx + (quirc_float_t)0.5);
+	capstone->center.y = (int)(ring_reg->cy + (quirc_float_t)0.5);
+	capstone->stone_x = stone_reg->cx;
+	capstone->stone_y = stone_reg->cy;
+	stone_reg->capstone = cs_index;
+	ring_reg->capstone = cs_index;
 }
 
-/* Read a cell from a grid using the currently set perspective
- * transform. Returns +/- 1 for black/white, 0 for cells which are
- * out of image bounds.
+/* Find the corners of a capstone, set up its perspective transform and
+ * its exact center. This is put off until the capstone looks like part
+ * of a grid, since most candidates in a cluttered image aren't.
  */
-static int read_cell(const struct quirc *q, int index, int x, int y)
+static void locate_capstone(struct quirc *q, int index)
 {
-	const struct quirc_grid *qr = &q->grids[index];
-	struct quirc_point p;
+	struct quirc_capstone *capstone = &q->capstones[index];
 
-	perspective_map(qr->c, x + (quirc_float_t)0.5, y + (quirc_float_t)0.5, &p);
-	if (p.y < 0 || p.y >= q->h || p.x < 0 || p.x >= q->w)
-		return 0;
+	if (capstone->located)
+		return;
+
+	/* Find the corners of the ring */
+	find_region_corners(q, capstone->ring,
+			    &q->regions[capstone->stone].seed,
+			    capstone->corners);
 
-	return q->pixels[p.y * q->w + p.x] ? 1 : -1;
+	/* Set up the perspective transform and find the center */
+	perspective_setup(capstone->c, capstone->corners, 7.0, 7.0);
+	perspective_map(capstone->c, 3.5, 3.5, &capstone->center);
+	capstone->located = 1;
 }
 
-static int fitness_cell(const struct quirc *q, int index, int x, int y)
+/* Could two capstones belong to the same grid? This is judged from the
+ * rings' areas and moments alone, so it must never reject a real pair.
+ *
+ * The ring's radius of gyration is about 3.5 modules, and the centers
+ * of two capstones of a version 40 grid are at most about 240 modules
+ * apart, so allow 70 radii. Perspective is unlikely to make one module
+ * more than four times the size of another.
+ */
+static int capstones_may_pair(const struct quirc *q, int a, int b)
 {
-	const struct quirc_grid *qr = &q->grids[index];
-	int score = 0;
-	int u, v;
+	const struct quirc_region *ra = &q->regions[q->capstones[a].ring];
+	const struct quirc_region *rb = &q->regions[q->capstones[b].ring];
+	const quirc_float_t dx = ra->cx - rb->cx;
+	const quirc_float_t dy = ra->cy - rb->cy;
+	quirc_float_t r2 = ra->mu20 + ra->mu02;
+
+	if ((int64_t)ra->count > (int64_t)rb->count * 16 ||
+	    (int64_t)rb->count > (int64_t)ra->count * 16)
+		return 0;
 
-	for (v = 0; v < 3; v++)
-		for (u = 0; u < 3; u++) {
-			static const quirc_float_t offsets[] = {0.3, 0.5, 0.7};
-			struct quirc_point p;
+	if (rb->mu20 + rb->mu02 > r2)
+		r2 = rb->mu20 + rb->mu02;
 
-			perspective_map(qr->c, x + offsets[u],
-					       y + offsets[v], &p);
-			if (p.y < 0 || p.y >= q->h || p.x < 0 || p.x >= q->w)
-				continue;
+	return dx * dx + dy * dy <= r2 * 70 * 70;
+}
 
-			if (q->pixels[p.y * q->w + p.x])
-				score++;
-			else
-				score--;
-		}
+static quirc_float_t ring_r2(const struct quirc *q, int index)
+{
+	const struct quirc_region *ring =
+		&q->regions[q->capstones[index].ring];
 
-	return score;
+	return ring->mu20 + ring->mu02;
 }
 
-static int fitness_ring(const struct quirc *q, int index, int cx, int cy,
-			int radius)
+/* Sort the capstones into classes by ring size, and into cells within
+ * each class by position, so that capstones_may_pair() need only be
+ * tried on nearby capstones.
+ */
+static int index_capstones(struct quirc *q)
 {
-	int i;
-	int score = 0;
+	int *cells;
+	int *next;
+	int num_cells = 0;
+	int i, k;
+
+	for (k = 0; k < QUIRC_CAPSTONE_CLASSES; k++) {
+		struct quirc_capstone_class *cls = &q->capstone_classes[k];
+
+		cls->shift = k + QUIRC_CAPSTONE_CELL_SHIFT;
+		cls->cols = ((q->w - 1) >> cls->shift) + 1;
+		cls->rows = ((q->h - 1) >> cls->shift) + 1;
+		cls->first_cell = num_cells;
+		cls->count = 0;
+		cls->max_r2 = 0;
+		num_cells += cls->cols * cls->rows;
+	}
 
-	for (i = 0; i < radius * 2; i++) {
-		score += fitness_cell(q, index, cx - radius + i, cy - radius);
-		score += fitness_cell(q, index, cx - radius, cy + radius - i);
-		score += fitness_cell(q, index, cx + radius, cy - radius + i);
-		score += fitness_cell(q, index, cx + radius - i, cy + radius);
+	cells = table_reserve(q->capstone_cells, &q->max_capstone_cells, 0,
+			      num_cells, sizeof(*cells));
+	if (!cells)
+		return -1;
+	q->capstone_cells = cells;
+
+	next = table_reserve(q->capstone_next, &q->max_capstone_next, 0,
+			     q->num_capstones, sizeof(*next));
+	if (!next)
+		return -1;
+	q->capstone_next = next;
+
+	for (i = 0; i < num_cells; i++)
+		cells[i] = -1;
+
+	/* Insert in reverse, so that each cell's list is in index order */
+	for (i = q->num_capstones - 1; i >= 0; i--) {
+		const struct quirc_region *ring =
+			&q->regions[q->capstones[i].ring];
+		const quirc_float_t r2 = ring_r2(q, i);
+		struct quirc_capstone_class *cls;
+		int x = ring->cx;
+		int y = ring->cy;
+		int cell;
+
+		for (k = 0; k + 1 < QUIRC_CAPSTONE_CLASSES; k++)
+			if (r2 < (quirc_float_t)((int64_t)4 << (k * 2)))
+				break;
+
+		cls = &q->capstone_classes[k];
+		x = x < 0 ? 0 : x >= q->w ? q->w - 1 : x;
+		y = y < 0 ? 0 : y >= q->h ? q->h - 1 : y;
+		cell = cls->first_cell + (y >> cls->shift) * cls->cols +
+			(x >> cls->shift);
+
+		next[i] = cells[cell];
+		cells[cell] = i;
+
+		cls->count++;
+		if (r2 > cls->max_r2)
+			cls->max_r2 = r2;
 	}
 
-	return score;
+	return 0;
 }
 
-static int fitness_apat(const struct quirc *q, int index, int cx, int cy)
+/* Map a coordinate range onto a range of cells, clamped to the image. */
+static void cell_range(quirc_float_t lo, quirc_float_t hi, int size,
+		       int shift, int *first, int *last)
 {
-	return fitness_cell(q, index, cx, cy) -
-		fitness_ring(q, index, cx, cy, 1) +
-		fitness_ring(q, index, cx, cy, 2);
+	lo = lo < 0 ? 0 : lo >= size ? size - 1 : lo;
+	hi = hi < 0 ? 0 : hi >= size ? size - 1 : hi;
+
+	*first = (int)lo >> shift;
+	*last = (int)hi >> shift;
 }
 
-static int fitness_capstone(const struct quirc *q, int index, int x, int y)
+/* Gather up to max capstones which capstones_may_pair() with the given
+ * one. The index must have been built. Returns the number found.
+ */
+static int find_partners(const struct quirc *q, int index, int *out,
+			 int max)
 {
-	x += 3;
-	y += 3;
+	const struct quirc_region *ring =
+		&q->regions[q->capstones[index].ring];
+	const quirc_float_t r2 = ring_r2(q, index);
+	int count = 0;
+	int k;
+
+	for (k = 0; k < QUIRC_CAPSTONE_CLASSES; k++) {
+		const struct quirc_capstone_class *cls =
+			&q->capstone_classes[k];
+		quirc_float_t reach;
+		int x0, x1, y0, y1;
+		int x, y;
+
+		if (!cls->count)
+			continue;
+
+		reach = sqrt(r2 > cls->max_r2 ? r2 : cls->max_r2) * 70;
+		cell_range(ring->cx - reach, ring->cx + reach, q->w,
+			   cls->shift, &x0, &x1);
+		cell_range(ring->cy - reach, ring->cy + reach, q->h,
+			   cls->shift, &y0, &y1);
+
+		for (y = y0; y <= y1; y++)
+			for (x = x0; x <= x1; x++) {
+				int j = q->capstone_cells[cls->first_cell +
+					y * cls->cols + x];
+
+				for (; j >= 0; j = q->capstone_next[j]) {
+					if (j == index ||
+					    !capstones_may_pair(q, index, j))
+						continue;
+
+					out[count++] = j;
+					if (count >= max)
+						return count;
+				}
+			}
+	}
 
-	return fitness_cell(q, index, x, y) +
-		fitness_ring(q, index, x, y, 1) -
-		fitness_ring(q, index, x, y, 2) +
-		fitness_ring(q, index, x, y, 3);
+	return count;
 }
 
-/* Compute a fitness score for the currently configured perspective
- * transform, using the features we expect to find by scanning the
- * grid.
+/* Locate each capstone which may pair with at least two others, as it
+ * must to be part of a grid.
  */
-static int fitness_all(const struct quirc *q, int index)
+static void locate_capstones(struct quirc *q)
 {
-	const struct quirc_grid *qr = &q->grids[index];
-	int version = (qr->grid_size - 17) / 4;
-	const struct quirc_version_info *info = &quirc_version_db[version];
-	int score = 0;
+	int partners[2];
+	int i;
+
+	for (i = 0; i < q->num_capstones; i++)
+		if (find_partners(q, i, partners, 2) >= 2)
+			locate_capstone(q, i);
+}
+
+/* Check that five run lengths are in the 1:1:3:1:1 proportion of a
+ * capstone, within a generous tolerance, plus slack pixels either way.
+ */
+static int is_finder_ratio(const unsigned int *pb, unsigned int slack)
+{
+	static const unsigned int check[5] = {1, 1, 3, 1, 1};
+	const unsigned int scale = 16;
+	unsigned int avg, err;
+	int i;
+
+	avg = (pb[0] + pb[1] + pb[3] + pb[4]) * scale / 4;
+	err = avg * 3 / 4 + slack * scale;
+
+	for (i = 0; i < 5; i++)
+		if (pb[i] * scale + err < check[i] * avg ||
+		    pb[i] * scale > check[i] * avg + err)
+			return 0;
+
+	return 1;
+}
+
+/* Measure the black, white and black runs met walking from the middle
+ * of a stone in the direction (dx, dy), up to the far edge of the ring.
+ * The stone run includes the starting pixel. Returns -1 if the ring
+ * isn't closed within limit pixels.
+ */
+static int cross_walk(const struct quirc *q, int x, int y, int dx, int dy,
+		      int limit, unsigned int *runs)
+{
+	int state = 0;
+	int n = 0;
+
+	runs[0] = runs[1] = runs[2] = 0;
+
+	while (x >= 0 && x < q->w && y >= 0 && y < q->h) {
+		if (quirc_is_black(q, x, y) != !(state & 1)) {
+			if (++state > 2)
+				return 0;
+		}
+
+		if (++n > limit)
+			return -1;
+
+		runs[state]++;
+		x += dx;
+		y += dy;
+	}
+
+	/* A ring cut off by the edge of the image is accepted */
+	return state == 2 ? 0 : -1;
+}
+
+/* Walk through the stone in direction (dx, dy) and check that the
+ * 1:1:3:1:1 pattern seen along the row is there as well. Any straight
+ * line through the centre of a capstone crosses it in the same
+ * proportions, whatever its rotation. This rejects most of the textures
+ * which happen to match along a single row before any regions are built
+ * for them.
+ *
+ * On success, the number of steps from (x, y) to the middle of the
+ * stone along this line is stored in *centre.
+ */
+static int cross_check(const struct quirc *q, int x, int y, int dx, int dy,
+		       int limit, int *centre)
+{
+	unsigned int fwd[3];
+	unsigned int back[3];
+	unsigned int pb[5];
+
+	if (cross_walk(q, x, y, dx, dy, limit, fwd) < 0 ||
+	    cross_walk(q, x, y, -dx, -dy, limit, back) < 0)
+		return 0;
+
+	pb[0] = back[2];
+	pb[1] = back[1];
+	pb[2] = back[0] + fwd[0] - 1;
+	pb[3] = fwd[1];
+	pb[4] = fwd[2];
+
+	*centre = ((int)fwd[0] - (int)back[0]) / 2;
+
+	/* Runs measured off the row are a pixel out more easily */
+	return is_finder_ratio(pb, 1);
+}
+
+static void test_capstone(struct quirc *q, unsigned int x, unsigned int y,
+			  unsigned int *pb)
+{
+	const int cx = x - pb[4] - pb[3] - (pb[2] + 1) / 2;
+	const int limit = (pb[0] + pb[1] + pb[2] + pb[3] + pb[4]) * 2;
+	int cy = y;
+	int offset;
+	int ring_right;
+	int stone;
+	int ring_left;
+	struct quirc_region *stone_reg;
+	struct quirc_region *ring_reg;
+	unsigned int ratio;
+
+	/* The row may cross the stone well off its middle, so the
+	 * diagonal goes through the centre found by the vertical check.
+	 */
+	if (!cross_check(q, cx, y, 0, 1, limit, &offset))
+		return;
+	cy += offset;
+	if (!cross_check(q, cx, cy, 1, 1, limit, &offset))
+		return;
+
+	ring_right = region_code(q, x - pb[4], y);
+	stone = region_code(q, x - pb[4] - pb[3] - pb[2], y);
+	ring_left = region_code(q, x - pb[4] - pb[3] -
+				pb[2] - pb[1] - pb[0],
+				y);
+
+	if (ring_left < 0 || ring_right < 0 || stone < 0)
+		return;
+
+	/* Left and ring of ring should be connected */
+	if (ring_left != ring_right)
+		return;
+
+	/* Ring should be disconnected from stone */
+	if (ring_left == stone)
+		return;
+
+	stone_reg = &q->regions[stone];
+	ring_reg = &q->regions[ring_left];
+
+	/* Already detected */
+	if (stone_reg->capstone >= 0 || ring_reg->capstone >= 0)
+		return;
+
+	/* Stone should be inside the ring */
+	if (stone_reg->left <= ring_reg->left ||
+	    stone_reg->right >= ring_reg->right ||
+	    stone_reg->top <= ring_reg->top ||
+	    stone_reg->bottom >= ring_reg->bottom)
+		return;
+
+	/* Ratio should ideally be 37.5 */
+	ratio = stone_reg->count * 100 / ring_reg->count;
+	if (ratio < 10 || ratio > 70)
+		return;
+
+	record_capstone(q, ring_left, stone);
+}
+
+/* Test the candidates found, which have all been gathered into
+ * bands[0] by now.
+ */
+static void flush_candidates(struct quirc *q)
+{
+	struct quirc_band *b = &q->bands[0];
+	int i;
+
+	for (i = 0; i < b->num_candidates; i++) {
+		struct quirc_candidate *c = &b->candidates[i];
+
+		test_capstone(q, c->x, c->y, c->pb);
+	}
+
+	b->num_candidates = 0;
+}
+
+/* finder_scan() runs on each row as soon as it has been thresholded,
+ * while it is still in cache. Regions can't be looked up until the rest
+ * of the image has been labelled too, so until then candidates are
+ * queued up rather than tested. If the queue can't grow, the candidate
+ * is dropped.
+ */
+static void queue_capstone(struct quirc_band *b, int x, int y,
+			   const unsigned int *pb)
+{
+	struct quirc_candidate *c;
+
+	c = table_reserve(b->candidates, &b->max_candidates,
+			  b->num_candidates, 1, sizeof(*c));
+	if (!c)
+		return;
+	b->candidates = c;
+
+	c = &b->candidates[b->num_candidates++];
+	c->x = x;
+	c->y = y;
+	memcpy(c->pb, pb, sizeof(c->pb));
+}
+
+/* Look for the 1:1:3:1:1 pattern of a capstone in each group of three
+ * consecutive black runs in a row, together with the two gaps between
+ * them. The pattern must be followed by a white pixel.
+ */
+static void finder_scan(const struct quirc *q, struct quirc_band *b, int y)
+{
+	const int last = b->row_runs[y - b->first_row + 1];
+	int i;
+
+	for (i = b->row_runs[y - b->first_row] + 2; i < last; i++) {
+		const struct quirc_run *r = &b->runs[i - 2];
+		unsigned int pb[5];
+
+		if (r[2].right + 1 >= q->w)
+			break;
+
+		pb[0] = r[0].right - r[0].left + 1;
+		pb[1] = r[1].left - r[0].right - 1;
+		pb[2] = r[1].right - r[1].left + 1;
+		pb[3] = r[2].left - r[1].right - 1;
+		pb[4] = r[2].right - r[2].left + 1;
+
+		if (is_finder_ratio(pb, 0))
+			queue_capstone(b, r[2].right + 1, y, pb);
+	}
+}
+
+static void find_alignment_pattern(struct quirc *q, int index)
+{
+	struct quirc_grid *qr = &q->grids[index];
+	struct quirc_capstone *c0 = &q->capstones[qr->caps[0]];
+	struct quirc_capstone *c2 = &q->capstones[qr->caps[2]];
+	struct quirc_point a;
+	struct quirc_point b;
+	struct quirc_point c;
+	int size_estimate;
+	int reach;
+	int step_size = 1;
+	int dir = 0;
+	quirc_float_t u, v;
+
+	/* Grab our previous estimate of the alignment pattern corner */
+	memcpy(&b, &qr->align, sizeof(b));
+
+	/* Guess another two corners of the alignment pattern so that we
+	 * can estimate its size.
+	 */
+	perspective_unmap(c0->c, &b, &u, &v);
+	perspective_map(c0->c, u, v + (quirc_float_t)1.0, &a);
+	perspective_unmap(c2->c, &b, &u, &v);
+	perspective_map(c2->c, u + (quirc_float_t)1.0, v, &c);
+
+	size_estimate = abs((a.x - b.x) * -(c.y - b.y) +
+			    (a.y - b.y) * (c.x - b.x));
+
+	reach = abs(b.x) > abs(b.x - q->w) ? abs(b.x) : abs(b.x - q->w);
+	if (abs(b.y) > reach)
+		reach = abs(b.y);
+	if (abs(b.y - q->h) > reach)
+		reach = abs(b.y - q->h);
+
+	/* Spiral outwards from the estimate point until we find something
+	 * roughly the right size. Don't look too far from the estimate
+	 * point. A bad grid can put the estimate far outside the image,
+	 * so legs which lie entirely outside are skipped, and the search
+	 * stops once it has covered the whole image.
+	 */
+	while (step_size * step_size < size_estimate * 100) {
+		static const int dx_map[] = {1, 0, -1, 0};
+		static const int dy_map[] = {0, -1, 0, 1};
+		int i;
+
+		if (step_size / 2 > reach)
+			break;
+
+		if (dx_map[dir] ? (b.y < 0 || b.y >= q->h) :
+				  (b.x < 0 || b.x >= q->w)) {
+			b.x += dx_map[dir] * step_size;
+			b.y += dy_map[dir] * step_size;
+		} else {
+			for (i = 0; i < step_size; i++) {
+				int code = region_code(q, b.x, b.y);
+
+				if (code >= 0) {
+					struct quirc_region *reg =
+						&q->regions[code];
+
+					if (reg->count >= size_estimate / 2 &&
+					    reg->count <= size_estimate * 2) {
+						qr->align_region = code;
+						return;
+					}
+				}
+
+				b.x += dx_map[dir];
+				b.y += dy_map[dir];
+			}
+		}
+
+		dir = (dir + 1) % 4;
+		if (!(dir & 1))
+			step_size++;
+	}
+}
+
+static void find_leftmost_to_line(void *user_data, int y, int left, int right)
+{
+	struct polygon_score_data *psd =
+		(struct polygon_score_data *)user_data;
+	int xs[2] = {left, right};
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		int d = -psd->ref.y * xs[i] + psd->ref.x * y;
+
+		if (d < psd->scores[0]) {
+			psd->scores[0] = d;
+			psd->corners[0].x = xs[i];
+			psd->corners[0].y = y;
+		}
+	}
+}
+
+static quirc_float_t length(struct quirc_point a, struct quirc_point b)
+{
+	quirc_float_t x = abs(a.x - b.x) + 1;
+	quirc_float_t y = abs(a.y - b.y) + 1;
+	return sqrt(x * x +  y * y);
+}
+/* Estimate grid size by determing distance between capstones
+ */
+static void measure_grid_size(struct quirc *q, int index)
+{
+	struct quirc_grid *qr = &q->grids[index];
+
+	struct quirc_capstone *a = &(q->capstones[qr->caps[0]]);
+	struct quirc_capstone *b = &(q->capstones[qr->caps[1]]);
+	struct quirc_capstone *c = &(q->capstones[qr->caps[2]]);
+
+	quirc_float_t ab = length(b->corners[0], a->corners[3]);
+	quirc_float_t capstone_ab_size = (length(b->corners[0], b->corners[3]) + length(a->corners[0], a->corners[3]))/2.0;
+	quirc_float_t ver_grid = (quirc_float_t)7.0 * ab / capstone_ab_size;
+
+	quirc_float_t bc = length(b->corners[0], c->corners[1]);
+	quirc_float_t capstone_bc_size = (length(b->corners[0], b->corners[1]) + length(c->corners[0], c->corners[1]))/2.0;
+	quirc_float_t hor_grid = (quirc_float_t)7.0 * bc / capstone_bc_size;
+
+	quirc_float_t grid_size_estimate = (ver_grid + hor_grid) * (quirc_float_t)(0.5);
+
+	int ver = (int)((grid_size_estimate - (quirc_float_t)(17.0 - 2.0)) * (quirc_float_t)(1./4));
+
+	qr->grid_size =  4*ver + 17;
+}
+
+/* The fitness score of a grid samples each cell it checks at nine
+ * points. The points only depend on the size of the grid, so they are
+ * laid out once, as a lattice which is then mapped through each
+ * candidate transform in batches.
+ */
+static void lattice_cell(struct quirc_lattice *l, int x, int y, int weight)
+{
+	static const float offsets[] = {0.3f, 0.5f, 0.7f};
+	int u, v;
+
+	for (v = 0; v < 3; v++)
+		for (u = 0; u < 3; u++) {
+			l->u[l->count] = x + offsets[u];
+			l->v[l->count] = y + offsets[v];
+			l->weight[l->count] = weight;
+			l->count++;
+		}
+}
+
+static void lattice_ring(struct quirc_lattice *l, int cx, int cy, int radius,
+			 int weight)
+{
+	int i;
+
+	for (i = 0; i < radius * 2; i++) {
+		lattice_cell(l, cx - radius + i, cy - radius, weight);
+		lattice_cell(l, cx - radius, cy + radius - i, weight);
+		lattice_cell(l, cx + radius, cy - radius + i, weight);
+		lattice_cell(l, cx + radius - i, cy + radius, weight);
+	}
+}
+
+static void lattice_apat(struct quirc_lattice *l, int cx, int cy)
+{
+	lattice_cell(l, cx, cy, 1);
+	lattice_ring(l, cx, cy, 1, -1);
+	lattice_ring(l, cx, cy, 2, 1);
+}
+
+static void lattice_capstone(struct quirc_lattice *l, int x, int y)
+{
+	x += 3;
+	y += 3;
+
+	lattice_cell(l, x, y, 1);
+	lattice_ring(l, x, y, 1, 1);
+	lattice_ring(l, x, y, 2, -1);
+	lattice_ring(l, x, y, 3, 1);
+}
+
+static int alignment_count(int version)
+{
+	const struct quirc_version_info *info;
+	int ap_count = 0;
+
+	if (version < 0 || version > QUIRC_MAX_VERSION)
+		return 0;
+
+	info = &quirc_version_db[version];
+	while ((ap_count < QUIRC_MAX_ALIGNMENT) && info->apat[ap_count])
+		ap_count++;
+
+	return ap_count;
+}
+
+/* Lay out the lattice for grids of the given size, unless it's already
+ * there. Returns 0 if the size is out of range or there's no memory for
+ * the lattice.
+ */
+static int setup_lattice(struct quirc *q, int grid_size)
+{
+	struct quirc_lattice *l = &q->lattice;
+	const int version = (grid_size - 17) / 4;
+	const int ap_count = alignment_count(version);
+	const int timing = grid_size > 14 ? grid_size - 14 : 0;
+	int cells = timing * 2 + 3 * 49;
+	int count;
 	int i, j;
-	int ap_count;
 
-	/* Check the timing pattern */
-	for (i = 0; i < qr->grid_size - 14; i++) {
+	if (l->count && l->grid_size == grid_size)
+		return 1;
+
+	if (grid_size > QUIRC_MAX_GRID_SIZE)
+		return 0;
+
+	if (ap_count > 2)
+		cells += (ap_count - 2) * 2 * 25;
+	if (ap_count > 1)
+		cells += (ap_count - 1) * (ap_count - 1) * 25;
+
+	count = cells * 9;
+	l->count = 0;
+
+	l->u = table_reserve(l->u, &l->max_u, 0, count, sizeof(l->u[0]));
+	if (!l->u)
+		goto fail;
+	l->v = table_reserve(l->v, &l->max_v, 0, count, sizeof(l->v[0]));
+	if (!l->v)
+		goto fail;
+	l->weight = table_reserve(l->weight, &l->max_weight, 0, count,
+				  sizeof(l->weight[0]));
+	if (!l->weight)
+		goto fail;
+
+	/* Capstones come first: they are the features a poor transform
+	 * is most quickly found to miss.
+	 */
+	lattice_capstone(l, 0, 0);
+	lattice_capstone(l, grid_size - 7, 0);
+	lattice_capstone(l, 0, grid_size - 7);
+
+	/* Timing pattern */
+	for (i = 0; i < timing; i++) {
 		int expect = (i & 1) ? 1 : -1;
 
-		score += fitness_cell(q, index, i + 7, 6) * expect;
-		score += fitness_cell(q, index, 6, i + 7) * expect;
+		lattice_cell(l, i + 7, 6, expect);
+		lattice_cell(l, 6, i + 7, expect);
+	}
+
+	/* Alignment patterns */
+	if (ap_count) {
+		const struct quirc_version_info *info =
+			&quirc_version_db[version];
+
+		for (i = 1; i + 1 < ap_count; i++) {
+			lattice_apat(l, 6, info->apat[i]);
+			lattice_apat(l, info->apat[i], 6);
+		}
+
+		for (i = 1; i < ap_count; i++)
+			for (j = 1; j < ap_count; j++)
+				lattice_apat(l, info->apat[i], info->apat[j]);
+	}
+
+	l->grid_size = grid_size;
+	return 1;
+
+fail:
+	/* Tables which did grow are kept, but their sizes may no longer
+	 * agree, so the lattice has to be laid out again next time.
+	 */
+	l->count = 0;
+	return 0;
+}
+
+/* Compute a fitness score for the currently configured perspective
+ * transform, using the features we expect to find by scanning the
+ * grid.
+ *
+ * Every point scores at most 1, so the score can't end up more than
+ * the number of points still to be sampled above what it is so far.
+ * Once that bound is no more than floor, sampling stops and the bound
+ * is returned instead: a transform which can't score more than floor
+ * isn't worth finishing.
+ */
+static int fitness_all(struct quirc *q, int index, int floor)
+{
+	const struct quirc_grid *qr = &q->grids[index];
+	const struct quirc_lattice *l = &q->lattice;
+	int32_t x[QUIRC_LATTICE_BATCH];
+	int32_t y[QUIRC_LATTICE_BATCH];
+	float c[QUIRC_PERSPECTIVE_PARAMS];
+	int score = 0;
+	int i, j;
+
+	if (!setup_lattice(q, qr->grid_size))
+		return 0;
+
+	for (i = 0; i < QUIRC_PERSPECTIVE_PARAMS; i++)
+		c[i] = qr->c[i];
+
+	for (i = 0; i < l->count; i += QUIRC_LATTICE_BATCH) {
+		const int n = l->count - i < QUIRC_LATTICE_BATCH ?
+			l->count - i : QUIRC_LATTICE_BATCH;
+
+		if (score + l->count - i <= floor)
+			return score + l->count - i;
+
+		q->kernels.map_points(c, l->u + i, l->v + i, x, y, n);
+
+		/* As in quirc_extract(), don't branch on the colour */
+		for (j = 0; j < n; j++) {
+			int black;
+
+			if ((uint32_t)x[j] >= (uint32_t)q->w ||
+			    (uint32_t)y[j] >= (uint32_t)q->h)
+				continue;
+
+			black = quirc_is_black(q, x[j], y[j]);
+			score += (black * 2 - 1) * l->weight[i + j];
+		}
+	}
+
+	return score;
+}
+
+static void jiggle_perspective(struct quirc *q, int index)
+{
+	struct quirc_grid *qr = &q->grids[index];
+	int best = fitness_all(q, index, INT_MIN);
+	int pass;
+	quirc_float_t adjustments[8];
+	int i;
+
+	/* Nothing can do better than a perfect score */
+	if (best >= q->lattice.count)
+		return;
+
+	for (i = 0; i < 8; i++)
+		adjustments[i] = qr->c[i] * (quirc_float_t)0.02;
+
+	for (pass = 0; pass < 5; pass++) {
+		for (i = 0; i < 16; i++) {
+			int j = i >> 1;
+			int test;
+			quirc_float_t old = qr->c[j];
+			quirc_float_t step = adjustments[j];
+			quirc_float_t new;
+
+			if (i & 1)
+				new = old + step;
+			else
+				new = old - step;
+
+			qr->c[j] = new;
+			test = fitness_all(q, index, best);
+
+			if (test > best)
+				best = test;
+			else
+				qr->c[j] = old;
+		}
+
+		for (i = 0; i < 8; i++)
+			adjustments[i] *= 0.5;
+	}
+}
+
+/************************************************************************
+ * Least-squares refinement
+ *
+ * Rather than searching the parameter space for the transform which
+ * scores best, features whose grid positions are known are measured in
+ * the image to sub-pixel precision, and the transform is fitted to them
+ * by Gauss-Newton iteration: the stone of each capstone and the corners
+ * of its ring (or the edges of both, if it was found in a decimated
+ * image), the centers of the alignment patterns, and every edge of the
+ * two timing patterns. These are measured again after each iteration,
+ * since where they're looked for depends on the transform.
+ */
+
+struct fit_point {
+	quirc_float_t		u;
+	quirc_float_t		v;
+	quirc_float_t		x;
+	quirc_float_t		y;
+};
+
+/* Pixel coordinates refer to the centers of pixels, so an edge between
+ * two pixels lies half a pixel from each, and the true corner of a ring
+ * lies half a pixel beyond the corner pixel found for it.
+ */
+static void add_corner_points(const struct quirc_capstone *cap,
+			      quirc_float_t ou, quirc_float_t ov,
+			      struct fit_point *pts, int *count)
+{
+	static const quirc_float_t du[4] = {0, 7, 7, 0};
+	static const quirc_float_t dv[4] = {0, 0, 7, 7};
+	int j;
+
+	for (j = 0; j < 4; j++) {
+		struct fit_point *p = &pts[(*count)++];
+		const quirc_float_t x = cap->corners[j].x;
+		const quirc_float_t y = cap->corners[j].y;
+
+		p->u = ou + du[j];
+		p->v = ov + dv[j];
+		p->x = x + (x > cap->stone_x ? (quirc_float_t)0.5 :
+			    (quirc_float_t)-0.5);
+		p->y = y + (y > cap->stone_y ? (quirc_float_t)0.5 :
+			    (quirc_float_t)-0.5);
+	}
+
+	pts[*count].u = ou + (quirc_float_t)3.5;
+	pts[*count].v = ov + (quirc_float_t)3.5;
+	pts[*count].x = cap->stone_x;
+	pts[*count].y = cap->stone_y;
+	(*count)++;
+}
+
+/* Find the edge of a timing pattern between the module before (u, v)
+ * and the one at it, stepping along the line between the middles of
+ * the two. The edge must be the only change of colour on the way.
+ * Returns 0 if it can't be found.
+ */
+static int find_timing_edge(const struct quirc *q, const quirc_float_t *c,
+			    quirc_float_t u, quirc_float_t v,
+			    quirc_float_t su, quirc_float_t sv,
+			    int black_first, struct fit_point *p)
+{
+	quirc_float_t x0, y0, x1, y1;
+	quirc_float_t px = 0, py = 0;
+	int steps;
+	int found = 0;
+	int i;
+
+	perspective_project(c, u - su * (quirc_float_t)0.5,
+			    v - sv * (quirc_float_t)0.5, &x0, &y0);
+	perspective_project(c, u + su * (quirc_float_t)0.5,
+			    v + sv * (quirc_float_t)0.5, &x1, &y1);
+
+	/* Two steps per pixel */
+	steps = (int)((fabs(x1 - x0) + fabs(y1 - y0)) * 2) + 2;
+	if (steps > 64)
+		steps = 64;
+
+	for (i = 0; i <= steps; i++) {
+		const quirc_float_t t = (quirc_float_t)i / steps;
+		const quirc_float_t x = x0 + (x1 - x0) * t;
+		const quirc_float_t y = y0 + (y1 - y0) * t;
+		const int ix = (int)rint(x);
+		const int iy = (int)rint(y);
+		int black;
+
+		if (ix < 0 || iy < 0 || ix >= q->w || iy >= q->h)
+			return 0;
+
+		black = quirc_is_black(q, ix, iy);
+		if (black != (black_first ^ found)) {
+			if (found || !i)
+				return 0;
+
+			found = 1;
+			px = (px + x) / 2;
+			py = (py + y) / 2;
+			continue;
+		}
+
+		if (!found) {
+			px = x;
+			py = y;
+		}
+	}
+
+	if (!found)
+		return 0;
+
+	p->u = u;
+	p->v = v;
+	p->x = px;
+	p->y = py;
+	return 1;
+}
+
+/* Add the features of a capstone at (ou, ov) in the grid. One found
+ * only in a decimated image has corners known to no better than a pixel
+ * or two, so the edges of its ring and stone are measured instead,
+ * along the middle row and column.
+ */
+static void add_capstone_points(const struct quirc *q, const quirc_float_t *c,
+				const struct quirc_capstone *cap,
+				quirc_float_t ou, quirc_float_t ov,
+				struct fit_point *pts, int *count)
+{
+	static const int edges[6] = {0, 1, 2, 5, 6, 7};
+	const quirc_float_t mid = (quirc_float_t)3.5;
+	int i;
+
+	if (cap->ring >= 0) {
+		add_corner_points(cap, ou, ov, pts, count);
+		return;
+	}
+
+	/* Colours alternate across the edges, starting from white */
+	for (i = 0; i < 6; i++) {
+		*count += find_timing_edge(q, c, ou + edges[i], ov + mid,
+					   1, 0, i & 1, &pts[*count]);
+		*count += find_timing_edge(q, c, ou + mid, ov + edges[i],
+					   0, 1, i & 1, &pts[*count]);
+	}
+}
+
+/* Find the middle of a black module by walking out to its edges across
+ * and down the image, for areas which have been thresholded but not
+ * scanned. Returns 0 if it's not between half and twice the given
+ * number of pixels across.
+ */
+static int module_center(const struct quirc *q, int x, int y, int size,
+			 quirc_float_t *cx, quirc_float_t *cy)
+{
+	int left = x;
+	int right = x;
+	int top = y;
+	int bottom = y;
+
+	if (!quirc_is_black(q, x, y))
+		return 0;
+
+	while (left > 0 && x - left < size * 2 &&
+	       quirc_is_black(q, left - 1, y))
+		left--;
+	while (right + 1 < q->w && right - x < size * 2 &&
+	       quirc_is_black(q, right + 1, y))
+		right++;
+	while (top > 0 && y - top < size * 2 &&
+	       quirc_is_black(q, x, top - 1))
+		top--;
+	while (bottom + 1 < q->h && bottom - y < size * 2 &&
+	       quirc_is_black(q, x, bottom + 1))
+		bottom++;
+
+	if ((right - left + 1) * 2 < size || right - left + 1 > size * 2 ||
+	    (bottom - top + 1) * 2 < size || bottom - top + 1 > size * 2)
+		return 0;
+
+	*cx = (quirc_float_t)(left + right) / 2;
+	*cy = (quirc_float_t)(top + bottom) / 2;
+	return 1;
+}
+
+/* Find the center of the alignment pattern whose middle module is at
+ * (u, v): the region under its predicted center, or the module there if
+ * it lies outside the areas scanned, must be about the size of one
+ * module. Returns 0 if there's no such module.
+ */
+static int find_alignment_center(struct quirc *q, const quirc_float_t *c,
+				 int u, int v, struct fit_point *p)
+{
+	struct quirc_point a, b, d;
+	int size_estimate;
+	quirc_float_t x, y;
+	int code;
+	int i, j;
+
+	perspective_map(c, u, v, &a);
+	perspective_map(c, u + 1, v, &b);
+	perspective_map(c, u, v + 1, &d);
+	size_estimate = abs((b.x - a.x) * (d.y - a.y) -
+			    (b.y - a.y) * (d.x - a.x));
+
+	perspective_map(c, u + (quirc_float_t)0.5, v + (quirc_float_t)0.5, &a);
+	if (a.x < 0 || a.y < 0 || a.x >= q->w || a.y >= q->h)
+		return 0;
+
+	code = region_code(q, a.x, a.y);
+	if (code >= 0) {
+		const struct quirc_region *reg = &q->regions[code];
+
+		if (reg->count < size_estimate / 2 ||
+		    reg->count > size_estimate * 2)
+			return 0;
+
+		x = reg->cx;
+		y = reg->cy;
+	} else if (!module_center(q, a.x, a.y, sqrt(size_estimate),
+				  &x, &y)) {
+		return 0;
+	}
+
+	/* A lone data module would pass that test too, so check for the
+	 * white ring around it and the black ring around that.
+	 */
+	for (i = -2; i <= 2; i++)
+		for (j = -2; j <= 2; j++) {
+			const int ring = abs(i) > abs(j) ? abs(i) : abs(j);
+
+			if (!ring)
+				continue;
+
+			perspective_map(c, u + i + (quirc_float_t)0.5,
+					v + j + (quirc_float_t)0.5, &a);
+			if (a.x < 0 || a.y < 0 || a.x >= q->w || a.y >= q->h ||
+			    quirc_is_black(q, a.x, a.y) != (ring == 2))
+				return 0;
+		}
+
+	p->u = u + (quirc_float_t)0.5;
+	p->v = v + (quirc_float_t)0.5;
+	p->x = x;
+	p->y = y;
+	return 1;
+}
+
+/* Gather the features of a grid, using its current transform to find
+ * the timing pattern edges and alignment patterns. Returns the number
+ * of points.
+ */
+static int fit_features(struct quirc *q, int index, struct fit_point *pts)
+{
+	const struct quirc_grid *qr = &q->grids[index];
+	const int version = (qr->grid_size - 17) / 4;
+	const quirc_float_t far = (quirc_float_t)(qr->grid_size - 7);
+	const quirc_float_t mid = (quirc_float_t)6.5;
+	int count = 0;
+	int i, j, k;
+
+	add_capstone_points(q, qr->c, &q->capstones[qr->caps[1]], 0, 0,
+			    pts, &count);
+	add_capstone_points(q, qr->c, &q->capstones[qr->caps[2]], far, 0,
+			    pts, &count);
+	add_capstone_points(q, qr->c, &q->capstones[qr->caps[0]], 0, far,
+			    pts, &count);
+
+	if (qr->align_region >= 0) {
+		const struct quirc_region *reg = &q->regions[qr->align_region];
+
+		pts[count].u = far + (quirc_float_t)0.5;
+		pts[count].v = far + (quirc_float_t)0.5;
+		pts[count].x = reg->cx;
+		pts[count].y = reg->cy;
+		count++;
+	} else if (version >= 2) {
+		/* Without a region, the transform may put the pattern
+		 * nearest the far corner a module out, so look around it.
+		 */
+		static const int du[] = {0, 1, -1, 0, 0, 1, 1, -1, -1};
+		static const int dv[] = {0, 0, 0, 1, -1, 1, -1, 1, -1};
+
+		for (i = 0; i < 9; i++)
+			if (find_alignment_center(q, qr->c, far + du[i],
+						  far + dv[i], &pts[count])) {
+				pts[count].u = far + (quirc_float_t)0.5;
+				pts[count].v = far + (quirc_float_t)0.5;
+				count++;
+				break;
+			}
+	}
+
+	/* The timing patterns run between the separators, starting with
+	 * a black module at 8.
+	 */
+	for (k = 8; k <= qr->grid_size - 8; k++) {
+		const int black_first = k & 1;
+
+		count += find_timing_edge(q, qr->c, k, mid, 1, 0,
+					  black_first, &pts[count]);
+		count += find_timing_edge(q, qr->c, mid, k, 0, 1,
+					  black_first, &pts[count]);
+	}
+
+	/* Every alignment pattern which doesn't overlap a capstone,
+	 * except the one already found.
+	 */
+	if (version >= 2 && version <= QUIRC_MAX_VERSION) {
+		const int *apat = quirc_version_db[version].apat;
+		int ap_count = 0;
+
+		while (ap_count < QUIRC_MAX_ALIGNMENT && apat[ap_count])
+			ap_count++;
+
+		for (i = 0; i < ap_count; i++)
+			for (j = 0; j < ap_count; j++) {
+				if ((!i && (!j || j == ap_count - 1)) ||
+				    (!j && i == ap_count - 1))
+					continue;
+				if (i == ap_count - 1 && j == ap_count - 1)
+					continue;
+
+				count += find_alignment_center(q, qr->c,
+					apat[i], apat[j], &pts[count]);
+			}
+	}
+
+	return count;
+}
+
+/* Solve the n-by-n system a.x = b in place, leaving x in b. Returns 0
+ * if the system is singular.
+ */
+static int solve_linear(quirc_float_t *a, quirc_float_t *b, int n)
+{
+	int i, j, k;
+
+	for (i = 0; i < n; i++) {
+		int pivot = i;
+
+		for (j = i + 1; j < n; j++)
+			if (fabs(a[j * n + i]) > fabs(a[pivot * n + i]))
+				pivot = j;
+
+		if (!(fabs(a[pivot * n + i]) > (quirc_float_t)1e-9))
+			return 0;
+
+		if (pivot != i) {
+			quirc_float_t t;
+
+			for (k = 0; k < n; k++) {
+				t = a[i * n + k];
+				a[i * n + k] = a[pivot * n + k];
+				a[pivot * n + k] = t;
+			}
+
+			t = b[i];
+			b[i] = b[pivot];
+			b[pivot] = t;
+		}
+
+		for (j = i + 1; j < n; j++) {
+			const quirc_float_t f = a[j * n + i] / a[i * n + i];
+
+			for (k = i; k < n; k++)
+				a[j * n + k] -= f * a[i * n + k];
+			b[j] -= f * b[i];
+		}
+	}
+
+	for (i = n - 1; i >= 0; i--) {
+		for (k = i + 1; k < n; k++)
+			b[i] -= a[i * n + k] * b[k];
+		b[i] /= a[i * n + i];
+	}
+
+	return 1;
+}
+
+/* Take one Gauss-Newton step towards the transform which best maps the
+ * given points. The columns of the normal equations are scaled to unit
+ * diagonal first, since the parameters differ in magnitude by several
+ * orders. Returns 0 if the step couldn't be taken.
+ */
+static int fit_step(quirc_float_t *c, const struct fit_point *pts, int count)
+{
+	const int n = QUIRC_PERSPECTIVE_PARAMS;
+	quirc_float_t jtj[QUIRC_PERSPECTIVE_PARAMS * QUIRC_PERSPECTIVE_PARAMS];
+	quirc_float_t jtr[QUIRC_PERSPECTIVE_PARAMS];
+	quirc_float_t scale[QUIRC_PERSPECTIVE_PARAMS];
+	int i, j, k;
+
+	memset(jtj, 0, sizeof(jtj));
+	memset(jtr, 0, sizeof(jtr));
+
+	for (i = 0; i < count; i++) {
+		const struct fit_point *p = &pts[i];
+		const quirc_float_t den = c[6] * p->u + c[7] * p->v + 1;
+		quirc_float_t mx, my;
+		quirc_float_t jx[QUIRC_PERSPECTIVE_PARAMS];
+		quirc_float_t jy[QUIRC_PERSPECTIVE_PARAMS];
+
+		if (!(den > 0))
+			return 0;
+
+		mx = (c[0] * p->u + c[1] * p->v + c[2]) / den;
+		my = (c[3] * p->u + c[4] * p->v + c[5]) / den;
+
+		jx[0] = p->u / den;
+		jx[1] = p->v / den;
+		jx[2] = 1 / den;
+		jx[3] = jx[4] = jx[5] = 0;
+		jx[6] = -p->u * mx / den;
+		jx[7] = -p->v * mx / den;
+
+		jy[0] = jy[1] = jy[2] = 0;
+		jy[3] = jx[0];
+		jy[4] = jx[1];
+		jy[5] = jx[2];
+		jy[6] = -p->u * my / den;
+		jy[7] = -p->v * my / den;
+
+		for (j = 0; j < n; j++) {
+			for (k = j; k < n; k++)
+				jtj[j * n + k] += jx[j] * jx[k] + jy[j] * jy[k];
+			jtr[j] += jx[j] * (p->x - mx) + jy[j] * (p->y - my);
+		}
+	}
+
+	for (j = 0; j < n; j++) {
+		if (!(jtj[j * n + j] > 0))
+			return 0;
+		scale[j] = 1 / sqrt(jtj[j * n + j]);
+	}
+
+	for (j = 0; j < n; j++) {
+		for (k = j; k < n; k++) {
+			jtj[j * n + k] *= scale[j] * scale[k];
+			jtj[k * n + j] = jtj[j * n + k];
+		}
+		jtr[j] *= scale[j];
+	}
+
+	if (!solve_linear(jtj, jtr, n))
+		return 0;
+
+	for (j = 0; j < n; j++)
+		c[j] += jtr[j] * scale[j];
+
+	return 1;
+}
+
+/* Fit the grid's transform to its features. If that fails, or scores
+ * worse than the transform we started with, fall back on searching.
+ */
+static void refine_perspective(struct quirc *q, int index)
+{
+	struct quirc_grid *qr = &q->grids[index];
+	struct fit_point pts[QUIRC_MAX_GRID_SIZE * 2 + 3 * 12 + 1 +
+			     QUIRC_MAX_ALIGNMENT * QUIRC_MAX_ALIGNMENT];
+	quirc_float_t saved[QUIRC_PERSPECTIVE_PARAMS];
+	const int before = fitness_all(q, index, INT_MIN);
+	int i;
+
+	memcpy(saved, qr->c, sizeof(saved));
+
+	for (i = 0; i < QUIRC_FIT_ITERATIONS; i++) {
+		const int count = fit_features(q, index, pts);
+
+		if (count < QUIRC_PERSPECTIVE_PARAMS ||
+		    !fit_step(qr->c, pts, count))
+			break;
+	}
+
+	if (i == QUIRC_FIT_ITERATIONS &&
+	    fitness_all(q, index, before - 1) >= before)
+		return;
+
+	memcpy(qr->c, saved, sizeof(saved));
+	jiggle_perspective(q, index);
+}
+
+/* Once the capstones are in place and an alignment point has been
+ * chosen, we call this function to set up a grid-reading perspective
+ * transform.
+ */
+static void setup_qr_perspective(struct quirc *q, int index)
+{
+	struct quirc_grid *qr = &q->grids[index];
+	struct quirc_point rect[4];
+
+	/* Set up the perspective map for reading the grid */
+	memcpy(&rect[0], &q->capstones[qr->caps[1]].corners[0],
+	       sizeof(rect[0]));
+	memcpy(&rect[1], &q->capstones[qr->caps[2]].corners[0],
+	       sizeof(rect[0]));
+	memcpy(&rect[2], &qr->align, sizeof(rect[0]));
+	memcpy(&rect[3], &q->capstones[qr->caps[0]].corners[0],
+	       sizeof(rect[0]));
+	perspective_setup(qr->c, rect, qr->grid_size - 7, qr->grid_size - 7);
+
+	/* Grids found in the areas of the full image scanned after a
+	 * decimated one are refined once the rest of them is thresholded.
+	 */
+	if (!q->defer_refine)
+		refine_perspective(q, index);
+}
+
+/* Rotate the capstone with so that corner 0 is the leftmost with respect
+ * to the given reference line.
+ */
+static void rotate_capstone(struct quirc_capstone *cap,
+			    const struct quirc_point *h0,
+			    const struct quirc_point *hd)
+{
+	struct quirc_point copy[4];
+	int j;
+	int best = 0;
+	int best_score = INT_MAX;
+
+	for (j = 0; j < 4; j++) {
+		struct quirc_point *p = &cap->corners[j];
+		int score = (p->x - h0->x) * -hd->y +
+			(p->y - h0->y) * hd->x;
+
+		if (!j || score < best_score) {
+			best = j;
+			best_score = score;
+		}
+	}
+
+	/* Rotate the capstone */
+	for (j = 0; j < 4; j++)
+		memcpy(&copy[j], &cap->corners[(j + best) % 4],
+		       sizeof(copy[j]));
+	memcpy(cap->corners, copy, sizeof(cap->corners));
+	perspective_setup(cap->c, cap->corners, 7.0, 7.0);
+}
+
+static void record_qr_grid(struct quirc *q, int a, int b, int c)
+{
+	struct quirc_point h0, hd;
+	int i;
+	int qr_index;
+	struct quirc_grid *qr;
+
+	if (q->num_grids >= q->grid_limit)
+		return;
+
+	qr = table_reserve(q->grids, &q->max_grids, q->num_grids, 1,
+			   sizeof(*qr));
+	if (!qr)
+		return;
+	q->grids = qr;
+
+	/* Construct the hypotenuse line from A to C. B should be to
+	 * the left of this line.
+	 */
+	memcpy(&h0, &q->capstones[a].center, sizeof(h0));
+	hd.x = q->capstones[c].center.x - q->capstones[a].center.x;
+	hd.y = q->capstones[c].center.y - q->capstones[a].center.y;
+
+	/* Make sure A-B-C is clockwise */
+	if ((q->capstones[b].center.x - h0.x) * -hd.y +
+	    (q->capstones[b].center.y - h0.y) * hd.x > 0) {
+		int swap = a;
+
+		a = c;
+		c = swap;
+		hd.x = -hd.x;
+		hd.y = -hd.y;
+	}
+
+	/* Record the grid and its components */
+	qr_index = q->num_grids;
+	qr = &q->grids[q->num_grids++];
+
+	memset(qr, 0, sizeof(*qr));
+	qr->caps[0] = a;
+	qr->caps[1] = b;
+	qr->caps[2] = c;
+	qr->align_region = -1;
+
+	/* Rotate each capstone so that corner 0 is top-left with respect
+	 * to the grid.
+	 */
+	for (i = 0; i < 3; i++) {
+		struct quirc_capstone *cap = &q->capstones[qr->caps[i]];
+
+		rotate_capstone(cap, &h0, &hd);
+		cap->qr_grid = qr_index;
+	}
+
+	/* Check the timing pattern by measuring grid size. This doesn't require a perspective
+	 * transform.
+	 */
+	measure_grid_size(q, qr_index);
+	/* Make an estimate based for the alignment pattern based on extending
+	 * lines from capstones A and C.
+	 */
+	if (!line_intersect(&q->capstones[a].corners[0],
+			    &q->capstones[a].corners[1],
+			    &q->capstones[c].corners[0],
+			    &q->capstones[c].corners[3],
+			    &qr->align))
+		goto fail;
+
+	/* On V2+ grids, we should use the alignment pattern. */
+	if (qr->grid_size > 21 && !q->level) {
+		/* Try to find the actual location of the alignment pattern. */
+		find_alignment_pattern(q, qr_index);
+
+		/* Find the point of the alignment pattern closest to the
+		 * top-left of the QR grid.
+		 */
+		if (qr->align_region >= 0) {
+			struct polygon_score_data psd;
+			struct quirc_region *reg =
+				&q->regions[qr->align_region];
+
+			/* Start from some point inside the alignment pattern */
+			memcpy(&qr->align, &reg->seed, sizeof(qr->align));
+
+			memcpy(&psd.ref, &hd, sizeof(psd.ref));
+			psd.corners = &qr->align;
+			psd.scores[0] = -hd.y * qr->align.x +
+				hd.x * qr->align.y;
+
+			region_spans(q, qr->align_region,
+				     find_leftmost_to_line, &psd);
+		}
+	}
+
+	setup_qr_perspective(q, qr_index);
+	return;
+
+fail:
+	/* We've been unable to complete setup for this grid. Undo what we've
+	 * recorded and pretend it never happened.
+	 */
+	for (i = 0; i < 3; i++)
+		q->capstones[qr->caps[i]].qr_grid = -1;
+	q->num_grids--;
+}
+
+/* Find how many modules along each of a capstone's axes a point lies
+ * from its centre, taking the capstone to be a parallelogram. Its
+ * perspective transform is no use this far out, as it magnifies the
+ * rounding of the corners to whole pixels.
+ */
+static void capstone_offset(const struct quirc_capstone *cap,
+			    const struct quirc_point *p,
+			    quirc_float_t *u, quirc_float_t *v)
+{
+	const struct quirc_point *k = cap->corners;
+	const quirc_float_t ux = (k[1].x - k[0].x + k[2].x - k[3].x) / 14.0;
+	const quirc_float_t uy = (k[1].y - k[0].y + k[2].y - k[3].y) / 14.0;
+	const quirc_float_t vx = (k[3].x - k[0].x + k[2].x - k[1].x) / 14.0;
+	const quirc_float_t vy = (k[3].y - k[0].y + k[2].y - k[1].y) / 14.0;
+	const quirc_float_t dx = p->x - (k[0].x + k[1].x + k[2].x + k[3].x) /
+		(quirc_float_t)4.0;
+	const quirc_float_t dy = p->y - (k[0].y + k[1].y + k[2].y + k[3].y) /
+		(quirc_float_t)4.0;
+	const quirc_float_t det = ux * vy - uy * vx;
+	quirc_float_t lu, lv;
+
+	if (det == 0) {
+		*u = *v = 0;
+		return;
+	}
+
+	/* The corners are the outermost pixels of the ring, so each side
+	 * spans a pixel less than its 7 modules. Small modules would
+	 * otherwise come out too small to tell one version from the next.
+	 */
+	lu = sqrt(ux * ux + uy * uy);
+	lv = sqrt(vx * vx + vy * vy);
+
+	*u = (dx * vy - dy * vx) / det * lu / (lu + (quirc_float_t)1.0 / 7);
+	*v = (ux * dy - uy * dx) / det * lv / (lv + (quirc_float_t)1.0 / 7);
+}
+
+/* How far a capstone is from lying on one of the axes of another, as
+ * the ratio of its offset across the axis to its distance along it.
+ */
+static quirc_float_t axis_offset(const struct quirc *q, int from, int to)
+{
+	quirc_float_t u, v;
+
+	capstone_offset(&q->capstones[from], &q->capstones[to].center,
+			&u, &v);
+	u = fabs(u);
+	v = fabs(v);
+
+	if (u < v)
+		return v > 0 ? u / v : 0;
+
+	return v / u;
+}
+
+/* How far three capstones, B being the corner, are from the shape of a
+ * grid: A and C the same distance from B, with no other capstones on
+ * the way to them, all three the same size, B lined up with A and C
+ * along their own axes as well as they are along its, and the distance
+ * a whole number of versions. Zero is a perfect fit, and each capstone
+ * in the way costs more than all the rest put together can.
+ */
+static quirc_float_t grouping_score(const struct quirc *q, int b,
+				    const struct quirc_neighbour *a,
+				    const struct quirc_neighbour *c)
+{
+	const quirc_float_t size = q->regions[q->capstones[b].ring].count;
+	const quirc_float_t da = fabs(a->distance);
+	const quirc_float_t dc = fabs(c->distance);
+	quirc_float_t version;
+	quirc_float_t score;
+
+	score = fabs((quirc_float_t)1.0 - da / dc);
+	score += fabs((quirc_float_t)1.0 -
+		      sqrt(q->regions[q->capstones[a->index].ring].count /
+			   size));
+	score += fabs((quirc_float_t)1.0 -
+		      sqrt(q->regions[q->capstones[c->index].ring].count /
+			   size));
+	score += axis_offset(q, a->index, b) + axis_offset(q, c->index, b);
+
+	/* Centres are 7 modules closer than the grid size, 17 + 4V */
+	version = ((da + dc) / 2 - 10) / 4;
+	score += fabs(version - floor(version + (quirc_float_t)0.5));
+
+	return score + (a->nearer + c->nearer) * 8;
+}
+
+/* Count the neighbours on an axis which lie nearer on the same side. */
+static void count_nearer(struct quirc_neighbour *list, int count)
+{
+	int j, k;
+
+	for (j = 0; j < count; j++) {
+		list[j].nearer = 0;
+
+		for (k = 0; k < count; k++)
+			if ((list[k].distance < 0) ==
+			    (list[j].distance < 0) &&
+			    fabs(list[k].distance) < fabs(list[j].distance))
+				list[j].nearer++;
+	}
+}
+
+/* Queue every pair of a capstone's neighbours, one on each axis, which
+ * may make a grid with it at the corner.
+ */
+static void test_neighbours(struct quirc *q, int i,
+			    struct quirc_neighbour *hlist, int hcount,
+			    struct quirc_neighbour *vlist, int vcount)
+{
+	int j, k;
+
+	count_nearer(hlist, hcount);
+	count_nearer(vlist, vcount);
+
+	for (j = 0; j < hcount; j++)
+		for (k = 0; k < vcount; k++) {
+			const struct quirc_neighbour *hn = &hlist[j];
+			const struct quirc_neighbour *vn = &vlist[k];
+			struct quirc_grouping *g;
+
+			if (fabs((quirc_float_t)1.0 -
+				 fabs(hn->distance / vn->distance)) >=
+			    (quirc_float_t)0.2)
+				continue;
+
+			g = table_reserve(q->groupings, &q->max_groupings,
+					  q->num_groupings, 1, sizeof(*g));
+			if (!g)
+				return;
+			q->groupings = g;
+
+			g = &q->groupings[q->num_groupings++];
+			g->caps[0] = hn->index;
+			g->caps[1] = i;
+			g->caps[2] = vn->index;
+			g->score = grouping_score(q, i, hn, vn);
+		}
+}
+
+static int int_compare(const void *a, const void *b)
+{
+	const int ia = *(const int *)a;
+	const int ib = *(const int *)b;
+
+	return (ia > ib) - (ia < ib);
+}
+
+static void test_grouping(struct quirc *q, unsigned int i)
+{
+	struct quirc_capstone *c1 = &q->capstones[i];
+	int *partners = q->capstone_partners;
+	struct quirc_neighbour *hlist;
+	struct quirc_neighbour *vlist;
+	int hcount = 0;
+	int vcount = 0;
+	int count;
+	int j;
+
+	if (!c1->located)
+		return;
+
+	/* Only capstones which may pair with this one are worth looking
+	 * at. They're taken in index order, so that ties are broken the
+	 * same way however the index is laid out.
+	 */
+	count = find_partners(q, i, partners, q->num_capstones);
+	if (!count)
+		return;
+	qsort(partners, count, sizeof(*partners), int_compare);
+
+	hlist = table_reserve(q->capstone_neighbours,
+			      &q->max_capstone_neighbours, 0, count * 2,
+			      sizeof(*hlist));
+	if (!hlist)
+		return;
+	q->capstone_neighbours = hlist;
+	vlist = hlist + count;
+
+	/* Look for potential neighbours by examining the relative gradients
+	 * from this capstone to others.
+	 */
+	for (j = 0; j < count; j++) {
+		struct quirc_capstone *c2 = &q->capstones[partners[j]];
+		quirc_float_t u, v;
+
+		if (!c2->located)
+			continue;
+
+		capstone_offset(c1, &c2->center, &u, &v);
+
+		if (fabs(u) < (quirc_float_t)0.2 * fabs(v)) {
+			hlist[hcount].index = partners[j];
+			hlist[hcount++].distance = v;
+		}
+
+		if (fabs(v) < (quirc_float_t)0.2 * fabs(u)) {
+			vlist[vcount].index = partners[j];
+			vlist[vcount++].distance = u;
+		}
+	}
+
+	test_neighbours(q, i, hlist, hcount, vlist, vcount);
+}
+
+static int grouping_compare(const void *a, const void *b)
+{
+	const struct quirc_grouping *ga = (const struct quirc_grouping *)a;
+	const struct quirc_grouping *gb = (const struct quirc_grouping *)b;
+	int i;
+
+	if (ga->score != gb->score)
+		return ga->score < gb->score ? -1 : 1;
+
+	for (i = 0; i < 3; i++)
+		if (ga->caps[i] != gb->caps[i])
+			return ga->caps[i] < gb->caps[i] ? -1 : 1;
+
+	return 0;
+}
+
+/* Group the capstones into grids. With many codes side by side, each
+ * capstone lines up with dozens of others, and a capstone of one code
+ * may be nearer to another code's than to its own partners. Rather than
+ * keep the nearest, every grouping is ranked by how well it fits the
+ * shape of a grid, and they're recorded best first, each only if none
+ * of its capstones is in a grid already.
+ */
+static void group_capstones(struct quirc *q)
+{
+	int i;
+
+	q->num_groupings = 0;
+
+	for (i = 0; i < q->num_capstones; i++)
+		test_grouping(q, i);
+
+	qsort(q->groupings, q->num_groupings, sizeof(q->groupings[0]),
+	      grouping_compare);
+
+	for (i = 0; i < q->num_groupings; i++) {
+		const struct quirc_grouping *g = &q->groupings[i];
+
+		if (q->capstones[g->caps[0]].qr_grid < 0 &&
+		    q->capstones[g->caps[1]].qr_grid < 0 &&
+		    q->capstones[g->caps[2]].qr_grid < 0)
+			record_qr_grid(q, g->caps[0], g->caps[1],
+				       g->caps[2]);
+	}
+}
+
+uint8_t *quirc_begin(struct quirc *q, int *w, int *h)
+{
+	q->num_regions = QUIRC_PIXEL_REGION;
+	q->num_capstones = 0;
+	q->num_grids = 0;
+	q->binary = 0;
+
+	if (w)
+		*w = q->w;
+	if (h)
+		*h = q->h;
+
+	return q->image;
+}
+
+uint8_t *quirc_begin_binary(struct quirc *q, int *w, int *h)
+{
+	uint8_t *image = quirc_begin(q, w, h);
+
+	q->binary = 1;
+	return image;
+}
+
+/************************************************************************
+ * Bands
+ */
+
+/* Threshold, label and scan each row of a band in turn. */
+static void scan_band(const struct quirc *q, struct quirc_band *b)
+{
+	int y;
+
+	b->num_runs = 0;
+	b->num_components = 0;
+	b->num_candidates = 0;
+	b->row_runs[0] = 0;
+
+	for (y = b->first_row; y < b->last_row; y++) {
+		threshold_row(q, b, y);
+		if (!(y % q->scan_stride))
+			finder_scan(q, b, y);
+	}
+}
+
+/* When only every Nth row has been scanned, scan the rows skipped on
+ * either side of each row with a candidate as well. This runs once all
+ * bands have been merged, so the rows of a neighbouring band are
+ * available, and the candidates are in row order.
+ */
+static void fill_candidates(struct quirc *q)
+{
+	struct quirc_band *b = &q->bands[0];
+	const int stride = q->scan_stride;
+	const int count = b->num_candidates;
+	int next = 0;
+	int i;
+
+	if (stride < 2)
+		return;
+
+	for (i = 0; i < count; i++) {
+		const int y = b->candidates[i].y;
+		int start = y - stride + 1;
+		int end = y + stride - 1;
+
+		if (start < next)
+			start = next;
+		if (end >= q->h)
+			end = q->h - 1;
+
+		for (; start <= end; start++)
+			if (start % stride)
+				finder_scan(q, b, start);
+
+		if (next <= end)
+			next = end + 1;
+	}
+}
+
+/* Divide the image into bands, one per thread, and return the number
+ * of bands. Bands are a whole number of threshold blocks high, so that
+ * each one starts a new row of blocks. bands[0] works in place on the
+ * decoder's own row index and threshold row.
+ */
+static int split_bands(struct quirc *q)
+{
+	int rows = (q->h + q->num_threads - 1) / q->num_threads;
+	int num_bands;
+	int i;
+
+	rows = (rows + QUIRC_THRESHOLD_BLOCK - 1) &
+		~(QUIRC_THRESHOLD_BLOCK - 1);
+	if (rows < QUIRC_BAND_MIN_ROWS)
+		rows = QUIRC_BAND_MIN_ROWS;
+
+	num_bands = (q->h + rows - 1) / rows;
+	if (num_bands < 1)
+		num_bands = 1;
+
+	q->bands[0].row_runs = q->row_runs;
+	q->bands[0].threshold_row = q->threshold_row;
+
+	for (i = 1; i < num_bands; i++) {
+		struct quirc_band *b = &q->bands[i];
+		int *row_runs;
+		uint8_t *threshold_row;
+
+		row_runs = table_reserve(b->row_runs, &b->max_row_runs, 0,
+					 rows + 1, sizeof(*row_runs));
+		if (row_runs)
+			b->row_runs = row_runs;
+
+		threshold_row = table_reserve(b->threshold_row,
+					      &b->max_threshold_row, 0,
+					      q->w, 1);
+		if (threshold_row)
+			b->threshold_row = threshold_row;
+
+		if (!row_runs || !threshold_row) {
+			num_bands = 1;
+			break;
+		}
+	}
+
+	for (i = 0; i < num_bands; i++) {
+		q->bands[i].first_row = i * rows;
+		q->bands[i].last_row = (i + 1) * rows;
+	}
+	q->bands[num_bands - 1].last_row = q->h;
+
+	return num_bands;
+}
+
+/* Append the runs and components of a band to the band above it, and
+ * join the components which meet at the seam. If the tables can't
+ * grow, the band's rows are left without any runs.
+ */
+static void merge_band(struct quirc_band *dst, const struct quirc_band *src)
+{
+	const int run_base = dst->num_runs;
+	const int comp_base = dst->num_components;
+	struct quirc_component *comps;
+	struct quirc_run *runs;
+	int y;
+	int i;
+
+	runs = table_reserve(dst->runs, &dst->max_runs, dst->num_runs,
+			     src->num_runs, sizeof(*runs));
+	if (runs)
+		dst->runs = runs;
+
+	comps = table_reserve(dst->components, &dst->max_components,
+			      dst->num_components, src->num_components,
+			      sizeof(*comps));
+	if (comps)
+		dst->components = comps;
+
+	if (!runs || !comps) {
+		for (y = src->first_row; y < src->last_row; y++)
+			dst->row_runs[y - dst->first_row + 1] = run_base;
+		dst->last_row = src->last_row;
+		return;
+	}
+
+	for (i = 0; i < src->num_runs; i++) {
+		struct quirc_run *run = &runs[run_base + i];
+
+		*run = src->runs[i];
+		run->component += comp_base;
+		if (run->next >= 0)
+			run->next += run_base;
+	}
+
+	for (i = 0; i < src->num_components; i++) {
+		struct quirc_component *comp = &comps[comp_base + i];
+
+		*comp = src->components[i];
+		comp->parent += comp_base;
+		comp->head += run_base;
+		comp->tail += run_base;
+	}
+
+	for (y = src->first_row; y < src->last_row; y++)
+		dst->row_runs[y - dst->first_row + 1] = run_base +
+			src->row_runs[y - src->first_row + 1];
+
+	dst->num_runs += src->num_runs;
+	dst->num_components += src->num_components;
+	dst->last_row = src->last_row;
+
+	join_rows(dst, src->first_row);
+}
+
+/* Append the candidates of a band to those of the band above. */
+static void merge_candidates(struct quirc_band *dst,
+			     const struct quirc_band *src)
+{
+	struct quirc_candidate *c;
+
+	if (!src->num_candidates)
+		return;
+
+	c = table_reserve(dst->candidates, &dst->max_candidates,
+			  dst->num_candidates, src->num_candidates,
+			  sizeof(*c));
+	if (!c)
+		return;
+	dst->candidates = c;
+
+	memcpy(c + dst->num_candidates, src->candidates,
+	       sizeof(*c) * src->num_candidates);
+	dst->num_candidates += src->num_candidates;
+}
+
+#ifdef QUIRC_THREADS
+struct band_job {
+	const struct quirc	*q;
+	struct quirc_band	*band;
+	pthread_t		thread;
+	int			started;
+};
+
+static void *band_thread(void *arg)
+{
+	struct band_job *job = (struct band_job *)arg;
+
+	scan_band(job->q, job->band);
+	return NULL;
+}
+#endif
+
+/* Scan all bands, the first on this thread and the rest on threads of
+ * their own, then merge them into the first. Any band whose thread
+ * can't be started is scanned here instead.
+ */
+static void scan_bands(struct quirc *q, int num_bands)
+{
+	struct quirc_band *const bands = q->bands;
+#ifdef QUIRC_THREADS
+	struct band_job *jobs = NULL;
+#endif
+	int i;
+
+#ifdef QUIRC_THREADS
+	if (num_bands > 1)
+		jobs = malloc(sizeof(*jobs) * num_bands);
+
+	for (i = 1; jobs && i < num_bands; i++) {
+		jobs[i].q = q;
+		jobs[i].band = &bands[i];
+		jobs[i].started = !pthread_create(&jobs[i].thread, NULL,
+						  band_thread, &jobs[i]);
+	}
+#endif
+
+	scan_band(q, &bands[0]);
+
+	for (i = 1; i < num_bands; i++) {
+#ifdef QUIRC_THREADS
+		if (jobs && jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+		else
+#endif
+			scan_band(q, &bands[i]);
+
+		merge_band(&bands[0], &bands[i]);
+		merge_candidates(&bands[0], &bands[i]);
+	}
+
+#ifdef QUIRC_THREADS
+	free(jobs);
+#endif
+}
+
+/* Threshold and scan the image at the current level, and group the
+ * capstones found. Unless setup is set, the threshold row (or block
+ * sums) must have been set up already. Returns -1 if memory ran out
+ * before the capstones could be grouped.
+ */
+static int scan_level(struct quirc *q, int setup)
+{
+	int *partners;
+
+	if (setup)
+		threshold_setup(q);
+
+	if (q->binary && q->w)
+		memset(q->threshold_row, 1, q->w);
+
+	q->num_spans = 0;
+
+	scan_bands(q, split_bands(q));
+	fill_candidates(q);
+	flush_candidates(q);
+
+	partners = table_reserve(q->capstone_partners,
+				 &q->max_capstone_partners, 0,
+				 q->num_capstones, sizeof(*partners));
+	if (!partners)
+		return -1;
+	q->capstone_partners = partners;
+
+	if (index_capstones(q) < 0)
+		return -1;
+
+	locate_capstones(q);
+
+	group_capstones(q);
+	return 0;
+}
+
+/************************************************************************
+ * Decimated scanning
+ *
+ * Codes are first found in a scaled-down copy of the image. Their grids
+ * are scaled back up, and only the areas around them, and around any
+ * capstones which couldn't be grouped, are scanned at full resolution.
+ * Grids found again there are kept, and the rest are refined against
+ * the full image from where the decimated image put them.
+ */
+
+/* Scale a point found at the given level up to the full image, taking
+ * it to the middle of the square of pixels it came from.
+ */
+static void lift_point(struct quirc_point *p, int shift)
+{
+	const int offset = ((1 << shift) - 1) >> 1;
+
+	p->x = p->x * (1 << shift) + offset;
+	p->y = p->y * (1 << shift) + offset;
+}
+
+static void lift_perspective(quirc_float_t *c, int shift)
+{
+	const quirc_float_t f = (quirc_float_t)(1 << shift);
+	const quirc_float_t offset = (f - 1) / 2;
+
+	c[0] = c[0] * f + c[6] * offset;
+	c[1] = c[1] * f + c[7] * offset;
+	c[2] = c[2] * f + offset;
+	c[3] = c[3] * f + c[6] * offset;
+	c[4] = c[4] * f + c[7] * offset;
+	c[5] = c[5] * f + offset;
+}
+
+/* Add the bounding box of some points, grown by margin pixels on each
+ * side, to the areas of the full image to scan. The box is clipped to
+ * each of the given regions of interest in turn (or to the image, if
+ * there are none), so it may add several areas, or none. Returns -1 if
+ * memory ran out.
+ */
+static int add_box(struct quirc *q, int *count,
+		   const struct quirc_point *points, int n, int margin,
+		   const struct quirc_rect *rois, int num_rois)
+{
+	const struct quirc_rect image = {0, 0, q->w, q->h};
+	int x0 = points[0].x;
+	int y0 = points[0].y;
+	int x1 = x0;
+	int y1 = y0;
+	int i;
+
+	for (i = 1; i < n; i++) {
+		if (points[i].x < x0)
+			x0 = points[i].x;
+		if (points[i].x > x1)
+			x1 = points[i].x;
+		if (points[i].y < y0)
+			y0 = points[i].y;
+		if (points[i].y > y1)
+			y1 = points[i].y;
+	}
+
+	if (!num_rois) {
+		rois = &image;
+		num_rois = 1;
+	}
+
+	for (i = 0; i < num_rois; i++) {
+		const struct quirc_rect *r = &rois[i];
+		struct quirc_rect *box;
+		int left = x0 - margin;
+		int top = y0 - margin;
+		int right = x1 + margin + 1;
+		int bottom = y1 + margin + 1;
+
+		if (left < r->x)
+			left = r->x;
+		if (top < r->y)
+			top = r->y;
+		if (right > r->x + r->w)
+			right = r->x + r->w;
+		if (bottom > r->y + r->h)
+			bottom = r->y + r->h;
+		if (left < 0)
+			left = 0;
+		if (top < 0)
+			top = 0;
+		if (right > q->w)
+			right = q->w;
+		if (bottom > q->h)
+			bottom = q->h;
+		if (left >= right || top >= bottom)
+			continue;
+
+		box = table_reserve(q->boxes, &q->max_boxes, *count, 1,
+				    sizeof(*box));
+		if (!box)
+			return -1;
+		q->boxes = box;
+
+		box = &q->boxes[(*count)++];
+		box->x = left;
+		box->y = top;
+		box->w = right - left;
+		box->h = bottom - top;
+	}
+
+	return 0;
+}
+
+/* Add the area a grid may cover to the boxes to scan. It's taken from
+ * the grid's capstones rather than its transform, which may be some
+ * way out: their corners, and those of capstone B mirrored across the
+ * line from A to C for the far corner, with the width of capstone B to
+ * spare for perspective. Returns -1 if memory ran out.
+ */
+static int add_grid_box(struct quirc *q, int *count,
+			const struct quirc_capstone *caps,
+			const struct quirc_grid *qr,
+			const struct quirc_rect *rois, int num_rois)
+{
+	const struct quirc_capstone *a = &caps[qr->caps[0]];
+	const struct quirc_capstone *b = &caps[qr->caps[1]];
+	const struct quirc_capstone *c = &caps[qr->caps[2]];
+	struct quirc_point points[20];
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		points[i] = a->corners[i];
+		points[4 + i] = b->corners[i];
+		points[8 + i] = c->corners[i];
+		points[12 + i].x = a->center.x + c->center.x -
+			b->corners[i].x;
+		points[12 + i].y = a->center.y + c->center.y -
+			b->corners[i].y;
+	}
+
+	perspective_map(qr->c, 0.0, 0.0, &points[16]);
+	perspective_map(qr->c, qr->grid_size, 0.0, &points[17]);
+	perspective_map(qr->c, qr->grid_size, qr->grid_size, &points[18]);
+	perspective_map(qr->c, 0.0, qr->grid_size, &points[19]);
+
+	return add_box(q, count, points, 20,
+		       abs(b->corners[2].x - b->corners[0].x) +
+		       abs(b->corners[2].y - b->corners[0].y),
+		       rois, num_rois);
+}
+
+/* Threshold a single pixel straight from the image, as binarize_span()
+ * would.
+ */
+static int pixel_is_black(const struct quirc *q, int x, int y)
+{
+	const uint8_t v = q->image[(size_t)y * q->w + x];
+
+	if (q->binary)
+		return v != 0;
+
+	if (adaptive_threshold(q))
+		return v < adaptive_block(q, x >> QUIRC_THRESHOLD_BLOCK_SHIFT,
+					  y >> QUIRC_THRESHOLD_BLOCK_SHIFT);
+
+	return v < q->threshold_row[x];
+}
+
+static int in_rects(const struct quirc_rect *rects, int count,
+		    const struct quirc_point *p)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (p->x >= rects[i].x && p->x < rects[i].x + rects[i].w &&
+		    p->y >= rects[i].y && p->y < rects[i].y + rects[i].h)
+			return 1;
+
+	return !count;
+}
+
+/* Check whether at least three quarters of the modules of a grid's
+ * timing patterns have the colour they should. Pixels are read straight
+ * from the image, so this works on areas which haven't been scanned,
+ * but not outside the given regions of interest.
+ */
+static int timing_fits(const struct quirc *q, const quirc_float_t *c,
+		       int grid_size, const struct quirc_rect *rois,
+		       int num_rois)
+{
+	int hits = 0;
+	int total = 0;
+	int k, i;
+
+	for (k = 7; k < grid_size - 7; k++)
+		for (i = 0; i < 2; i++) {
+			struct quirc_point p;
+
+			if (i)
+				perspective_map(c, 6.5, k + 0.5, &p);
+			else
+				perspective_map(c, k + 0.5, 6.5, &p);
+
+			total++;
+			if (p.x >= 0 && p.y >= 0 && p.x < q->w &&
+			    p.y < q->h && in_rects(rois, num_rois, &p) &&
+			    pixel_is_black(q, p.x, p.y) == !(k & 1))
+				hits++;
+		}
+
+	return hits * 4 >= total * 3;
+}
+
+/* Drop the grids found in the decimated image whose timing patterns
+ * don't show up. Capstones paired up by chance make grids which may
+ * span most of the image, and would otherwise have all of it scanned
+ * again. The capstones of a grid dropped are looked at on their own,
+ * like any others which aren't in a grid, so a real code which just
+ * doesn't survive being scaled down isn't lost.
+ */
+static void drop_weak_grids(struct quirc *q)
+{
+	int count = 0;
+	int i, j;
+
+	for (i = 0; i < q->num_capstones; i++)
+		q->capstones[i].qr_grid = -1;
+
+	for (i = 0; i < q->num_grids; i++) {
+		const struct quirc_grid *qr = &q->grids[i];
+
+		if (!timing_fits(q, qr->c, qr->grid_size, NULL, 0))
+			continue;
+
+		q->grids[count] = *qr;
+		for (j = 0; j < 3; j++)
+			q->capstones[qr->caps[j]].qr_grid = count;
+		count++;
+	}
+
+	q->num_grids = count;
+}
+
+/* Scale the grids and capstones found in the decimated image up to the
+ * full image. The areas the grids cover are added to the boxes first,
+ * and their number stored in grid_boxes: these are only thresholded,
+ * for the grids to be refined against. The areas around capstones not
+ * in a grid follow, and are scanned. Returns the number of boxes, or -1
+ * if memory ran out.
+ */
+static int lift_results(struct quirc *q, int *grid_boxes)
+{
+	const int shift = q->pyramid;
+	int count = 0;
+	int i, j;
+
+	for (i = 0; i < q->num_grids; i++) {
+		struct quirc_grid *qr = &q->grids[i];
+		struct quirc_point corners[4];
+
+		lift_point(&qr->align, shift);
+		for (j = 0; j < 3; j++)
+			lift_point(&qr->tpep[j], shift);
+		lift_perspective(qr->c, shift);
+
+		/* Leave room for the grid to move while it's refined */
+		perspective_map(qr->c, 0.0, 0.0, &corners[0]);
+		perspective_map(qr->c, qr->grid_size, 0.0, &corners[1]);
+		perspective_map(qr->c, qr->grid_size, qr->grid_size,
+				&corners[2]);
+		perspective_map(qr->c, 0.0, qr->grid_size, &corners[3]);
+
+		if (add_box(q, &count, corners, 4, 2 << shift,
+			    q->rois, q->num_rois) < 0)
+			return -1;
+	}
+
+	*grid_boxes = count;
+
+	for (i = 0; i < q->num_capstones; i++) {
+		struct quirc_capstone *cap = &q->capstones[i];
+
+		for (j = 0; j < 4; j++)
+			lift_point(&cap->corners[j], shift);
+		lift_point(&cap->center, shift);
+		lift_perspective(cap->c, shift);
+		cap->stone_x = cap->stone_x * (1 << shift) +
+			(quirc_float_t)((1 << shift) - 1) / 2;
+		cap->stone_y = cap->stone_y * (1 << shift) +
+			(quirc_float_t)((1 << shift) - 1) / 2;
+
+		if (cap->qr_grid < 0) {
+			const int size = abs(cap->corners[2].x -
+					     cap->corners[0].x) +
+				abs(cap->corners[2].y - cap->corners[0].y);
+
+			if (add_box(q, &count, cap->corners, 4,
+				    size * QUIRC_PYRAMID_REACH,
+				    q->rois, q->num_rois) < 0)
+				return -1;
+		}
+	}
+
+	return count;
+}
+
+/* Set the grids found in the decimated image aside, along with all the
+ * capstones. In the table set aside, qr_grid is -2 for the capstones
+ * used by a grid, and -1 for the rest. Returns the number of capstones
+ * used, or -1 if memory ran out.
+ */
+static int set_aside_grids(struct quirc *q)
+{
+	struct quirc_grid *grids;
+	struct quirc_capstone *caps;
+	int used = 0;
+	int i, j;
+
+	grids = table_reserve(q->lifted_grids, &q->max_lifted_grids, 0,
+			      q->num_grids, sizeof(*grids));
+	if (!grids)
+		return -1;
+	q->lifted_grids = grids;
+
+	caps = table_reserve(q->lifted_capstones, &q->max_lifted_capstones,
+			     0, q->num_capstones, sizeof(*caps));
+	if (!caps)
+		return -1;
+	q->lifted_capstones = caps;
+
+	memcpy(grids, q->grids, sizeof(*grids) * q->num_grids);
+	memcpy(caps, q->capstones, sizeof(*caps) * q->num_capstones);
+
+	for (i = 0; i < q->num_capstones; i++)
+		caps[i].qr_grid = -1;
+
+	for (i = 0; i < q->num_grids; i++)
+		for (j = 0; j < 3; j++) {
+			struct quirc_capstone *cap = &caps[grids[i].caps[j]];
+
+			if (cap->qr_grid == -1) {
+				cap->qr_grid = -2;
+				used++;
+			}
+		}
+
+	q->num_lifted_grids = q->num_grids;
+	q->num_regions = QUIRC_PIXEL_REGION;
+	q->num_capstones = 0;
+	q->num_grids = 0;
+	return used;
+}
+
+/* Check whether the boxes scanned cover the part of the rectangle from
+ * (x0, y0) to (x1, y1) inclusive which lies on the image.
+ */
+static int area_scanned(const struct quirc *q, int x0, int y0, int x1, int y1)
+{
+	int y;
+
+	x0 = x0 < 0 ? 0 : x0;
+	y0 = y0 < 0 ? 0 : y0;
+	x1 = x1 >= q->w ? q->w - 1 : x1;
+	y1 = y1 >= q->h ? q->h - 1 : y1;
+
+	for (y = y0; y <= y1; y++) {
+		int next = 0;
+		int left, right;
+
+		do {
+			if (!roi_span(q, y, 0, 0, &next, &left, &right))
+				return 0;
+		} while (left > x0 || right < x1);
 	}
 
-	/* Check capstones */
-	score += fitness_capstone(q, index, 0, 0);
-	score += fitness_capstone(q, index, qr->grid_size - 7, 0);
-	score += fitness_capstone(q, index, 0, qr->grid_size - 7);
-
-	if (version < 0 || version > QUIRC_MAX_VERSION)
-		return score;
+	return 1;
+}
 
-	/* Check alignment patterns */
-	ap_count = 0;
-	while ((ap_count < QUIRC_MAX_ALIGNMENT) && info->apat[ap_count])
-		ap_count++;
+/* Threshold boxes from first up to last into the bit plane, without
+ * extracting any runs. Pixels are always thresholded the same way, so
+ * the boxes may overlap each other and the areas already scanned.
+ */
+static void threshold_boxes(struct quirc *q, int first, int last)
+{
+	uint8_t *threshold = q->threshold_row;
+	int i, y;
+
+	for (i = first; i < last; i++) {
+		const struct quirc_rect *box = &q->boxes[i];
+		int block = -1;
+
+		for (y = box->y; y < box->y + box->h; y++) {
+			if (adaptive_threshold(q) &&
+			    y >> QUIRC_THRESHOLD_BLOCK_SHIFT != block) {
+				block = y >> QUIRC_THRESHOLD_BLOCK_SHIFT;
+				threshold = q->bands[0].threshold_row;
+				adaptive_row(q, threshold, block);
+			}
 
-	for (i = 1; i + 1 < ap_count; i++) {
-		score += fitness_apat(q, index, 6, info->apat[i]);
-		score += fitness_apat(q, index, info->apat[i], 6);
+			binarize_span(q, threshold, y, box->x,
+				      box->x + box->w - 1);
+		}
 	}
+}
 
-	for (i = 1; i < ap_count; i++)
-		for (j = 1; j < ap_count; j++)
-			score += fitness_apat(q, index,
-					info->apat[i], info->apat[j]);
+/* Set up a transform for a grid from its capstones alone, taking the
+ * far corner to complete a parallelogram rather than trusting the
+ * alignment pattern, which may have been looked for outside the boxes
+ * scanned. The capstones may since have been turned to suit other
+ * grids, so copies are turned back.
+ */
+static void capstone_frame(const struct quirc *q, const struct quirc_grid *qr,
+			   quirc_float_t *c)
+{
+	struct quirc_capstone caps[3];
+	struct quirc_point rect[4];
+	struct quirc_point hd;
+	int i;
 
-	return score;
+	for (i = 0; i < 3; i++)
+		caps[i] = q->capstones[qr->caps[i]];
+
+	hd.x = caps[2].center.x - caps[0].center.x;
+	hd.y = caps[2].center.y - caps[0].center.y;
+	for (i = 0; i < 3; i++)
+		rotate_capstone(&caps[i], &caps[0].center, &hd);
+
+	rect[0] = caps[1].corners[0];
+	rect[1] = caps[2].corners[0];
+	rect[2].x = caps[0].corners[0].x + caps[2].corners[0].x -
+		caps[1].corners[0].x;
+	rect[2].y = caps[0].corners[0].y + caps[2].corners[0].y -
+		caps[1].corners[0].y;
+	rect[3] = caps[0].corners[0];
+	perspective_setup(c, rect, qr->grid_size - 7, qr->grid_size - 7);
 }
 
-static void jiggle_perspective(struct quirc *q, int index)
+/* A grid found at full resolution may be made of capstones from boxes
+ * which don't cover the rest of it. If so, and its timing patterns show
+ * up, the area it may cover is thresholded so that it can be refined
+ * and read. Boxes from count onwards are used as scratch space.
+ */
+static void cover_grids(struct quirc *q, const struct quirc_rect *rois,
+			int num_rois, int count)
 {
-	struct quirc_grid *qr = &q->grids[index];
-	int best = fitness_all(q, index);
-	int pass;
-	quirc_float_t adjustments[8];
+	const int scanned = q->rois - q->boxes;
 	int i;
 
-	for (i = 0; i < 8; i++)
-		adjustments[i] = qr->c[i] * (quirc_float_t)0.02;
-
-	for (pass = 0; pass < 5; pass++) {
-		for (i = 0; i < 16; i++) {
-			int j = i >> 1;
-			int test;
-			quirc_float_t old = qr->c[j];
-			quirc_float_t step = adjustments[j];
-			quirc_float_t new;
+	for (i = 0; i < q->num_grids; i++) {
+		const int first = count;
+		const struct quirc_rect *box;
+		quirc_float_t c[QUIRC_PERSPECTIVE_PARAMS];
+
+		if (add_grid_box(q, &count, q->capstones, &q->grids[i],
+				 rois, num_rois) < 0)
+			return;
+		q->rois = q->boxes + scanned;
+
+		for (box = &q->boxes[first]; box < &q->boxes[count]; box++)
+			if (!area_scanned(q, box->x, box->y,
+					  box->x + box->w - 1,
+					  box->y + box->h - 1))
+				break;
+
+		if (box != &q->boxes[count])
+			capstone_frame(q, &q->grids[i], c);
+
+		if (box != &q->boxes[count] &&
+		    timing_fits(q, c, q->grids[i].grid_size, rois, num_rois))
+			threshold_boxes(q, first, count);
+		count = first;
+	}
+}
 
-			if (i & 1)
-				new = old + step;
-			else
-				new = old - step;
+/* Refine the grids found at full resolution, now that the areas they
+ * cover have been thresholded. Each grid's capstones are turned to suit
+ * it first, as they may be shared with others since found.
+ */
+static void refine_grids(struct quirc *q)
+{
+	int i, j;
 
-			qr->c[j] = new;
-			test = fitness_all(q, index);
+	for (i = 0; i < q->num_grids; i++) {
+		const struct quirc_grid *qr = &q->grids[i];
+		struct quirc_point h0, hd;
 
-			if (test > best)
-				best = test;
-			else
-				qr->c[j] = old;
-		}
+		h0 = q->capstones[qr->caps[0]].center;
+		hd.x = q->capstones[qr->caps[2]].center.x - h0.x;
+		hd.y = q->capstones[qr->caps[2]].center.y - h0.y;
+		for (j = 0; j < 3; j++)
+			rotate_capstone(&q->capstones[qr->caps[j]], &h0, &hd);
 
-		for (i = 0; i < 8; i++)
-			adjustments[i] *= 0.5;
+		refine_perspective(q, i);
 	}
 }
 
-/* Once the capstones are in place and an alignment point has been
- * chosen, we call this function to set up a grid-reading perspective
- * transform.
+/* Look up the region of a capstone set aside which lies under the
+ * given point of it, if its size is about right for the number of
+ * modules it should cover. Returns -1 if there isn't one.
  */
-static void setup_qr_perspective(struct quirc *q, int index)
+static int capstone_region(struct quirc *q, const struct quirc_capstone *cap,
+			   quirc_float_t u, quirc_float_t v, int modules)
 {
-	struct quirc_grid *qr = &q->grids[index];
-	struct quirc_point rect[4];
-
-	/* Set up the perspective map for reading the grid */
-	memcpy(&rect[0], &q->capstones[qr->caps[1]].corners[0],
-	       sizeof(rect[0]));
-	memcpy(&rect[1], &q->capstones[qr->caps[2]].corners[0],
-	       sizeof(rect[0]));
-	memcpy(&rect[2], &qr->align, sizeof(rect[0]));
-	memcpy(&rect[3], &q->capstones[qr->caps[0]].corners[0],
-	       sizeof(rect[0]));
-	perspective_setup(qr->c, rect, qr->grid_size - 7, qr->grid_size - 7);
+	const struct quirc_point *k = cap->corners;
+	struct quirc_point p;
+	int size_estimate;
+	int code;
+
+	/* Twice the area of the ring's outline, which is 49 modules */
+	size_estimate = abs((k[1].x - k[3].x) * (k[2].y - k[0].y) -
+			    (k[1].y - k[3].y) * (k[2].x - k[0].x)) *
+		modules / (49 * 2);
+
+	perspective_map(cap->c, u, v, &p);
+	code = region_code(q, p.x, p.y);
+	if (code < 0 ||
+	    q->regions[code].count < size_estimate / 2 ||
+	    q->regions[code].count > size_estimate * 2)
+		return -1;
 
-	jiggle_perspective(q, index);
+	return code;
 }
 
-/* Rotate the capstone with so that corner 0 is the leftmost with respect
- * to the given reference line.
+/* Find a capstone set aside again in the full image, and take its
+ * corners from there. If it can't be found, it keeps its scaled-up
+ * corners.
  */
-static void rotate_capstone(struct quirc_capstone *cap,
-			    const struct quirc_point *h0,
-			    const struct quirc_point *hd)
+static void relocate_capstone(struct quirc *q, struct quirc_capstone *cap)
 {
-	struct quirc_point copy[4];
-	int j;
-	int best = 0;
-	int best_score = INT_MAX;
+	const struct quirc_region *stone_reg;
+	int stone, ring;
 
-	for (j = 0; j < 4; j++) {
-		struct quirc_point *p = &cap->corners[j];
-		int score = (p->x - h0->x) * -hd->y +
-			(p->y - h0->y) * hd->x;
+	cap->ring = -1;
+	cap->stone = -1;
 
-		if (!j || score < best_score) {
-			best = j;
-			best_score = score;
-		}
-	}
+	stone = capstone_region(q, cap, 3.5, 3.5, 9);
+	ring = capstone_region(q, cap, 0.5, 3.5, 24);
+	if (stone < 0 || ring < 0 || stone == ring)
+		return;
 
-	/* Rotate the capstone */
-	for (j = 0; j < 4; j++)
-		memcpy(&copy[j], &cap->corners[(j + best) % 4],
-		       sizeof(copy[j]));
-	memcpy(cap->corners, copy, sizeof(cap->corners));
+	stone_reg = &q->regions[stone];
+
+	cap->stone = stone;
+	cap->ring = ring;
+	cap->stone_x = stone_reg->cx;
+	cap->stone_y = stone_reg->cy;
+
+	find_region_corners(q, ring, &stone_reg->seed, cap->corners);
 	perspective_setup(cap->c, cap->corners, 7.0, 7.0);
+	perspective_map(cap->c, 3.5, 3.5, &cap->center);
 }
 
-static void record_qr_grid(struct quirc *q, int a, int b, int c)
+/* Check whether the middle of a grid set aside lies on a grid found at
+ * full resolution.
+ */
+static int found_again(const struct quirc *q, const struct quirc_grid *qr)
 {
-	struct quirc_point h0, hd;
+	struct quirc_point p;
 	int i;
-	int qr_index;
-	struct quirc_grid *qr;
 
-	if (q->num_grids >= QUIRC_MAX_GRIDS)
-		return;
-
-	/* Construct the hypotenuse line from A to C. B should be to
-	 * the left of this line.
-	 */
-	memcpy(&h0, &q->capstones[a].center, sizeof(h0));
-	hd.x = q->capstones[c].center.x - q->capstones[a].center.x;
-	hd.y = q->capstones[c].center.y - q->capstones[a].center.y;
+	perspective_map(qr->c, qr->grid_size * 0.5, qr->grid_size * 0.5, &p);
 
-	/* Make sure A-B-C is clockwise */
-	if ((q->capstones[b].center.x - h0.x) * -hd.y +
-	    (q->capstones[b].center.y - h0.y) * hd.x > 0) {
-		int swap = a;
+	for (i = 0; i < q->num_grids; i++) {
+		const struct quirc_grid *other = &q->grids[i];
+		quirc_float_t u, v;
 
-		a = c;
-		c = swap;
-		hd.x = -hd.x;
-		hd.y = -hd.y;
+		perspective_unmap(other->c, &p, &u, &v);
+		if (u >= 0 && v >= 0 && u <= other->grid_size &&
+		    v <= other->grid_size)
+			return 1;
 	}
 
-	/* Record the grid and its components */
-	qr_index = q->num_grids;
-	qr = &q->grids[q->num_grids++];
+	return 0;
+}
 
-	memset(qr, 0, sizeof(*qr));
-	qr->caps[0] = a;
-	qr->caps[1] = b;
-	qr->caps[2] = c;
-	qr->align_region = -1;
+/* Add the grids set aside which weren't found again at full resolution
+ * to those which were, and refine them against the full image. Each
+ * capstone is added once, the first time a grid needs it, and its
+ * qr_grid in the table set aside then holds its new index.
+ */
+static void restore_grids(struct quirc *q)
+{
+	struct quirc_point h0, hd;
+	int i, j;
 
-	/* Rotate each capstone so that corner 0 is top-left with respect
-	 * to the grid.
-	 */
-	for (i = 0; i < 3; i++) {
-		struct quirc_capstone *cap = &q->capstones[qr->caps[i]];
+	for (i = 0; i < q->num_lifted_grids; i++) {
+		struct quirc_capstone *caps;
+		struct quirc_grid *qr;
 
-		rotate_capstone(cap, &h0, &hd);
-		cap->qr_grid = qr_index;
-	}
+		if (q->num_grids >= q->grid_limit ||
+		    q->num_capstones + 3 > q->capstone_limit)
+			break;
 
-	/* Check the timing pattern by measuring grid size. This doesn't require a perspective
-	 * transform.
-	 */
-	measure_grid_size(q, qr_index);
-	/* Make an estimate based for the alignment pattern based on extending
-	 * lines from capstones A and C.
-	 */
-	if (!line_intersect(&q->capstones[a].corners[0],
-			    &q->capstones[a].corners[1],
-			    &q->capstones[c].corners[0],
-			    &q->capstones[c].corners[3],
-			    &qr->align))
-		goto fail;
+		if (found_again(q, &q->lifted_grids[i]))
+			continue;
 
-	/* On V2+ grids, we should use the alignment pattern. */
-	if (qr->grid_size > 21) {
-		/* Try to find the actual location of the alignment pattern. */
-		find_alignment_pattern(q, qr_index);
+		caps = table_reserve(q->capstones, &q->max_capstones,
+				     q->num_capstones, 3, sizeof(*caps));
+		if (!caps)
+			break;
+		q->capstones = caps;
 
-		/* Find the point of the alignment pattern closest to the
-		 * top-left of the QR grid.
-		 */
-		if (qr->align_region >= 0) {
-			struct polygon_score_data psd;
-			struct quirc_region *reg =
-				&q->regions[qr->align_region];
+		qr = table_reserve(q->grids, &q->max_grids, q->num_grids, 1,
+				   sizeof(*qr));
+		if (!qr)
+			break;
+		q->grids = qr;
 
-			/* Start from some point inside the alignment pattern */
-			memcpy(&qr->align, &reg->seed, sizeof(qr->align));
+		qr = &q->grids[q->num_grids];
+		*qr = q->lifted_grids[i];
 
-			memcpy(&psd.ref, &hd, sizeof(psd.ref));
-			psd.corners = &qr->align;
-			psd.scores[0] = -hd.y * qr->align.x +
-				hd.x * qr->align.y;
+		for (j = 0; j < 3; j++) {
+			struct quirc_capstone *cap =
+				&q->lifted_capstones[qr->caps[j]];
+
+			if (cap->qr_grid < 0) {
+				caps[q->num_capstones] = *cap;
+				relocate_capstone(q, &caps[q->num_capstones]);
+				cap->qr_grid = q->num_capstones++;
+			}
 
-			flood_fill_seed(q, reg->seed.x, reg->seed.y,
-					qr->align_region, QUIRC_PIXEL_BLACK,
-					NULL, NULL);
-			flood_fill_seed(q, reg->seed.x, reg->seed.y,
-					QUIRC_PIXEL_BLACK, qr->align_region,
-					find_leftmost_to_line, &psd);
+			qr->caps[j] = cap->qr_grid;
+			caps[qr->caps[j]].qr_grid = q->num_grids;
 		}
-	}
 
-	setup_qr_perspective(q, qr_index);
-	return;
+		/* Capstones located again have lost their orientation, and
+		 * those shared with other grids may have been turned to
+		 * suit them.
+		 */
+		h0 = caps[qr->caps[0]].center;
+		hd.x = caps[qr->caps[2]].center.x - h0.x;
+		hd.y = caps[qr->caps[2]].center.y - h0.y;
+		for (j = 0; j < 3; j++)
+			rotate_capstone(&caps[qr->caps[j]], &h0, &hd);
 
-fail:
-	/* We've been unable to complete setup for this grid. Undo what we've
-	 * recorded and pretend it never happened.
-	 */
-	for (i = 0; i < 3; i++)
-		q->capstones[qr->caps[i]].qr_grid = -1;
-	q->num_grids--;
+		/* The alignment region was found in the decimated image */
+		qr->align_region = -1;
+
+		refine_perspective(q, q->num_grids++);
+	}
+
+	q->num_lifted_grids = 0;
 }
 
-struct neighbour {
-	int		index;
-	quirc_float_t		distance;
-};
+/* Scale the w pixel wide image down into q->image, which must already
+ * be set up as the decimated level. With regions of interest, only the
+ * pixels wholly inside them are filled in, and the rest are white.
+ */
+static void decimate_image(struct quirc *q, const uint8_t *image, int w)
+{
+	int y;
 
-struct neighbour_list {
-	struct neighbour	n[QUIRC_MAX_CAPSTONES];
-	int			count;
-};
+	for (y = 0; y < q->h; y++) {
+		const uint8_t *src = image + ((size_t)y << q->level) * w;
+		uint8_t *dst = q->image + (size_t)y * q->w;
+		int next = 0;
+		int left, right;
 
-static void test_neighbours(struct quirc *q, int i,
-			    const struct neighbour_list *hlist,
-			    const struct neighbour_list *vlist)
-{
-	/* Test each possible grouping */
-	for (int j = 0; j < hlist->count; j++) {
-		const struct neighbour *hn = &hlist->n[j];
-		for (int k = 0; k < vlist->count; k++) {
-			const struct neighbour *vn = &vlist->n[k];
-			quirc_float_t squareness = fabs((quirc_float_t)1.0 - hn->distance / vn->distance);
-			if (squareness < (quirc_float_t)0.2)
-				record_qr_grid(q, hn->index, i, vn->index);
+		if (!q->num_rois) {
+			q->kernels.decimate(src, w, q->level, dst, q->w);
+			continue;
 		}
+
+		memset(dst, q->binary ? 0 : UINT8_MAX, q->w);
+		while (roi_span(q, y, 0, 0, &next, &left, &right))
+			q->kernels.decimate(src + (left << q->level), w,
+					    q->level, dst + left,
+					    right - left + 1);
 	}
 }
 
-static void test_grouping(struct quirc *q, unsigned int i)
+/* Scan the image at the decimated level, then the areas of the full
+ * image picked out. Returns 0 if that couldn't be done, in which case
+ * the whole image should be scanned as usual.
+ */
+static int scan_pyramid(struct quirc *q, int setup)
 {
-	struct quirc_capstone *c1 = &q->capstones[i];
-	int j;
-	struct neighbour_list hlist;
-	struct neighbour_list vlist;
+	const int shift = q->pyramid;
+	const int w = q->w;
+	const int h = q->h;
+	const int stride = q->stride;
+	const int scan_stride = q->scan_stride;
+	uint8_t *const image = q->image;
+	struct quirc_rect *const rois = q->rois;
+	const int num_rois = q->num_rois;
+	uint8_t *small;
+	int count = -1;
+	int grid_boxes = 0;
+	int used;
+
+	if (!(w >> shift) || !(h >> shift))
+		return 0;
 
-	hlist.count = 0;
-	vlist.count = 0;
+	small = table_reserve(q->small_image, &q->max_small_image, 0,
+			      (w >> shift) * (h >> shift), 1);
+	if (!small)
+		return 0;
+	q->small_image = small;
+
+	q->image = small;
+	q->w = w >> shift;
+	q->h = h >> shift;
+	q->stride = (q->w + 63) >> 6;
+	q->level = shift;
+	q->scan_stride = scan_stride >> shift;
+	if (q->scan_stride < 1)
+		q->scan_stride = 1;
+
+	decimate_image(q, image, w);
+	used = scan_level(q, setup);
+	drop_weak_grids(q);
+
+	q->image = image;
+	q->w = w;
+	q->h = h;
+	q->stride = stride;
+	q->level = 0;
+	q->scan_stride = scan_stride;
+
+	if (used >= 0)
+		count = lift_results(q, &grid_boxes);
+	used = count < 0 ? -1 : set_aside_grids(q);
+	if (used < 0) {
+		q->num_regions = QUIRC_PIXEL_REGION;
+		q->num_capstones = 0;
+		q->num_grids = 0;
+		q->num_lifted_grids = 0;
+		return 0;
+	}
 
-	/* Look for potential neighbours by examining the relative gradients
-	 * from this capstone to others.
+	if (!count) {
+		/* Nothing to look at, but leave the planes valid */
+		memset(q->row_runs, 0, sizeof(q->row_runs[0]) * (h + 1));
+		memset(q->bits, 0, sizeof(q->bits[0]) * stride * h);
+		return 1;
+	}
+
+	/* Block sums are needed at full resolution, over the regions of
+	 * interest rather than the boxes, so that thresholds are the same
+	 * as in a plain scan. Averaging blurs the edges of modules into
+	 * grey, which shifts a global threshold chosen from the decimated
+	 * image, so it's chosen again from rows of the full image.
 	 */
-	for (j = 0; j < q->num_capstones; j++) {
-		struct quirc_capstone *c2 = &q->capstones[j];
-		quirc_float_t u, v;
+	if (adaptive_threshold(q)) {
+		integral_setup(q);
+	} else if (setup && !q->binary && !q->video_mode) {
+		unsigned int histogram[UINT8_MAX + 1];
+		const unsigned int n = sample_histogram(q, 0, 1 << shift,
+							histogram);
+
+		memset(q->threshold_row, otsu(histogram, n), w);
+	} else {
+		memset(q->threshold_row, q->threshold_row[0], w);
+	}
 
-		if (i == j)
-			continue;
+	/* Keep room for the grids set aside */
+	q->capstone_limit -= used;
+	q->grid_limit -= q->num_lifted_grids;
+	q->defer_refine = 1;
 
-		perspective_unmap(c1->c, &c2->center, &u, &v);
+	if (count == grid_boxes) {
+		memset(q->row_runs, 0, sizeof(q->row_runs[0]) * (h + 1));
+		memset(q->bits, 0, sizeof(q->bits[0]) * stride * h);
+	}
 
-		u = fabs(u - (quirc_float_t)3.5);
-		v = fabs(v - (quirc_float_t)3.5);
+	if (count > grid_boxes) {
+		quirc_sort_rects(q->boxes + grid_boxes, count - grid_boxes);
+		q->rois = q->boxes + grid_boxes;
+		q->num_rois = count - grid_boxes;
 
-		if (u < (quirc_float_t)0.2 * v) {
-			struct neighbour *n = &hlist.n[hlist.count++];
+		scan_level(q, 0);
+		cover_grids(q, rois, num_rois, count);
+	}
 
-			n->index = j;
-			n->distance = v;
-		}
+	q->defer_refine = 0;
+	q->capstone_limit += used;
+	q->grid_limit += q->num_lifted_grids;
+	q->rois = rois;
+	q->num_rois = num_rois;
 
-		if (v < (quirc_float_t)0.2 * u) {
-			struct neighbour *n = &vlist.n[vlist.count++];
+	threshold_boxes(q, 0, grid_boxes);
+	refine_grids(q);
+	restore_grids(q);
+	return 1;
+}
 
-			n->index = j;
-			n->distance = u;
-		}
-	}
+static void identify(struct quirc *q, int setup)
+{
+	/* Nothing to do until the decoder has been sized */
+	if (!q->row_runs)
+		return;
 
-	if (!(hlist.count && vlist.count))
+	if (q->pyramid && scan_pyramid(q, setup))
 		return;
 
-	test_neighbours(q, i, &hlist, &vlist);
+	scan_level(q, setup);
 }
 
-static void pixels_setup(struct quirc *q, uint8_t threshold)
+void quirc_end(struct quirc *q)
 {
-	if (QUIRC_PIXEL_ALIAS_IMAGE) {
-		q->pixels = (quirc_pixel_t *)q->image;
-	}
-
-	uint8_t* source = q->image;
-	quirc_pixel_t* dest = q->pixels;
-	int length = q->w * q->h;
-	while (length--) {
-		uint8_t value = *source++;
-		*dest++ = (value < threshold) ? QUIRC_PIXEL_BLACK : QUIRC_PIXEL_WHITE;
-	}
+	q->fixed_threshold = 0;
+	identify(q, 1);
 }
 
-uint8_t *quirc_begin(struct quirc *q, int *w, int *h)
+void quirc_end_with_threshold(struct quirc *q, uint8_t threshold)
 {
-	q->num_regions = QUIRC_PIXEL_REGION;
-	q->num_capstones = 0;
-	q->num_grids = 0;
+	if (!q->binary && q->w)
+		memset(q->threshold_row, threshold, q->w);
 
-	if (w)
-		*w = q->w;
-	if (h)
-		*h = q->h;
-
-	return q->image;
+	q->fixed_threshold = 1;
+	identify(q, 0);
 }
 
-void quirc_end(struct quirc *q)
+void quirc_end_with_histogram(struct quirc *q, const unsigned int *histogram)
 {
+	unsigned int numPixels = 0;
 	int i;
 
-	uint8_t threshold = otsu(q);
-	pixels_setup(q, threshold);
+	for (i = 0; i <= UINT8_MAX; i++)
+		numPixels += histogram[i];
+
+	quirc_end_with_threshold(q, otsu(histogram, numPixels));
+}
 
-	for (i = 0; i < q->h; i++)
-		finder_scan(q, i);
+/* Store the low count bits of word at dst, least significant first */
+static void store_bits(uint8_t *dst, uint64_t word, int count)
+{
+	int i;
 
-	for (i = 0; i < q->num_capstones; i++)
-		test_grouping(q, i);
+	for (i = 0; i < count; i += 8) {
+		*dst++ = word;
+		word >>= 8;
+	}
 }
 
 void quirc_extract(const struct quirc *q, int index,
 		   struct quirc_code *code)
 {
 	const struct quirc_grid *qr = &q->grids[index];
-	int y;
-	int i = 0;
+	int32_t px[QUIRC_MAX_GRID_SIZE];
+	int32_t py[QUIRC_MAX_GRID_SIZE];
+	float c[QUIRC_PERSPECTIVE_PARAMS];
+	const uint32_t w = q->w;
+	const uint32_t h = q->h;
+	uint64_t word = 0;
+	int bit = 0;
+	int x, y;
 
 	memset(code, 0, sizeof(*code));
 
@@ -1141,13 +4060,35 @@ void quirc_extract(const struct quirc *q, int index,
 	if (code->size > QUIRC_MAX_GRID_SIZE)
 		return;
 
+	for (x = 0; x < QUIRC_PERSPECTIVE_PARAMS; x++)
+		c[x] = qr->c[x];
+
+	/* Map each row of cell centres in one pass, and pack the cells
+	 * into the bitmap a word at a time.
+	 */
 	for (y = 0; y < qr->grid_size; y++) {
-		int x;
+		q->kernels.map_row(c, 0.5f, y + 0.5f, px, py, qr->grid_size);
+
+		/* Cells are black or white about equally often, so the
+		 * bit is merged in without a branch on its value.
+		 */
 		for (x = 0; x < qr->grid_size; x++) {
-			if (read_cell(q, index, x, y) > 0) {
-				code->cell_bitmap[i >> 3] |= (1 << (i & 7));
+			uint64_t black = 0;
+
+			if ((uint32_t)px[x] < w && (uint32_t)py[x] < h)
+				black = quirc_is_black(q, px[x], py[x]);
+
+			word |= black << (bit & 63);
+
+			if (!(++bit & 63)) {
+				store_bits(code->cell_bitmap + ((bit - 64) >> 3),
+					   word, 64);
+				word = 0;
 			}
-			i++;
 		}
 	}
+
+	if (bit & 63)
+		store_bits(code->cell_bitmap + ((bit & ~63) >> 3), word,
+			   bit & 63);
 }
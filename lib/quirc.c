@@ -14,6 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include "quirc_internal.h"
@@ -31,27 +32,96 @@ struct quirc *quirc_new(void)
 		return NULL;
 
 	memset(q, 0, sizeof(*q));
+
+	q->bands = calloc(1, sizeof(*q->bands));
+	if (!q->bands) {
+		free(q);
+		return NULL;
+	}
+
+	q->num_threads = 1;
+	q->scan_stride = 1;
+	q->video_level = -1;
+	q->region_limit = QUIRC_MAX_REGIONS - QUIRC_PIXEL_REGION;
+	q->capstone_limit = QUIRC_MAX_CAPSTONES;
+	q->grid_limit = QUIRC_MAX_GRIDS;
+	quirc_select_kernels(&q->kernels);
 	return q;
 }
 
+/* Allocate the summed-area table of block sums used by adaptive
+ * thresholding, with an extra leading row and column of zeroes.
+ */
+static struct quirc_block_sum *integral_alloc(int w, int h)
+{
+	size_t bw = ((size_t)w + QUIRC_THRESHOLD_BLOCK - 1) >>
+		QUIRC_THRESHOLD_BLOCK_SHIFT;
+	size_t bh = ((size_t)h + QUIRC_THRESHOLD_BLOCK - 1) >>
+		QUIRC_THRESHOLD_BLOCK_SHIFT;
+
+	return calloc((bw + 1) * (bh + 1), sizeof(struct quirc_block_sum));
+}
+
+/* Free the tables of a band. bands[0] borrows its row index and
+ * threshold row from the decoder.
+ */
+static void band_free(struct quirc_band *b, int borrowed)
+{
+	if (!borrowed) {
+		free(b->row_runs);
+		free(b->threshold_row);
+	}
+	free(b->runs);
+	free(b->components);
+	free(b->candidates);
+}
+
 void quirc_destroy(struct quirc *q)
 {
+	int i;
+
+	for (i = 0; i < q->num_threads; i++)
+		band_free(&q->bands[i], !i);
+	free(q->bands);
 	free(q->image);
-	/* q->pixels may alias q->image when their type representation is of the
-	   same size, so we need to be careful here to avoid a double free */
-	if (!QUIRC_PIXEL_ALIAS_IMAGE)
-		free(q->pixels);
-	free(q->flood_fill_vars);
+	free(q->bits);
+	free(q->row_runs);
+	free(q->spans);
+	free(q->threshold_row);
+	free(q->integral);
+	free(q->regions);
+	free(q->capstones);
+	free(q->grids);
+	free(q->capstone_cells);
+	free(q->capstone_next);
+	free(q->capstone_partners);
+	free(q->capstone_neighbours);
+	free(q->groupings);
+	free(q->lattice.u);
+	free(q->lattice.v);
+	free(q->lattice.weight);
+	free(q->rois);
+	free(q->small_image);
+	free(q->boxes);
+	free(q->lifted_grids);
+	free(q->lifted_capstones);
 	free(q);
 }
 
 int quirc_resize(struct quirc *q, int w, int h)
 {
 	uint8_t		*image  = NULL;
-	quirc_pixel_t	*pixels = NULL;
-	size_t num_vars;
-	size_t vars_byte_size;
-	struct quirc_flood_fill_vars *vars = NULL;
+	uint64_t	*bits = NULL;
+	int		*row_runs = NULL;
+	struct quirc_run *runs = NULL;
+	int		stride;
+	int		max_runs;
+	struct quirc_component *components = NULL;
+	int		max_components;
+	struct quirc_span *spans = NULL;
+	int		max_spans;
+	uint8_t		*threshold_row = NULL;
+	struct quirc_block_sum *integral = NULL;
 
 	/*
 	 * XXX: w and h should be size_t (or at least unsigned) as negatives
@@ -83,63 +153,229 @@ int quirc_resize(struct quirc *q, int w, int h)
 	 */
 	(void)memcpy(image, q->image, min);
 
-	/* alloc a new buffer for q->pixels if needed */
-	if (!QUIRC_PIXEL_ALIAS_IMAGE) {
-		pixels = calloc(newdim, sizeof(quirc_pixel_t));
-		if (!pixels)
-			goto fail;
-	}
+	/* alloc the thresholded image, at one bit per pixel */
+	stride = (w + 63) / 64;
+	bits = calloc(stride && h ? (size_t)stride * h : 1, sizeof(*bits));
+	if (!bits)
+		goto fail;
 
 	/*
-	 * alloc the work area for the flood filling logic.
-	 *
-	 * the size was chosen with the following assumptions and observations:
-	 *
-	 * - rings are the regions which requires the biggest work area.
-	 * - they consumes the most when they are rotated by about 45 degree.
-	 *   in that case, the necessary depth is about (2 * height_of_the_ring).
-	 * - the maximum height of rings would be about 1/3 of the image height.
+	 * alloc the run lists, components and region spans. quirc_end() grows
+	 * these if an image needs more; this is enough for most.
 	 */
+	row_runs = calloc((size_t)h + 1, sizeof(*row_runs));
+	if (!row_runs)
+		goto fail;
 
-	if ((size_t)h * 2 / 2 != h) {
-		goto fail; /* size_t overflow */
-	}
-	num_vars = (size_t)h * 2 / 3;
-	if (num_vars == 0) {
-		num_vars = 1;
-	}
+	max_runs = h ? (h < INT_MAX / 16 ? h * 16 : INT_MAX) : 1;
+	runs = malloc(sizeof(*runs) * max_runs);
+	if (!runs)
+		goto fail;
 
-	vars_byte_size = sizeof(*vars) * num_vars;
-	if (vars_byte_size / sizeof(*vars) != num_vars) {
-		goto fail; /* size_t overflow */
-	}
-	vars = malloc(vars_byte_size);
-	if (!vars)
+	max_components = h ? (h < INT_MAX / 4 ? h * 4 : INT_MAX) : 1;
+	components = malloc(sizeof(*components) * max_components);
+	if (!components)
+		goto fail;
+
+	max_spans = h ? (h < INT_MAX / 4 ? h * 4 : INT_MAX) : 1;
+	spans = malloc(sizeof(*spans) * max_spans);
+	if (!spans)
+		goto fail;
+
+	/* alloc the per-row thresholds, and the block sums if needed */
+	threshold_row = malloc(w ? w : 1);
+	if (!threshold_row)
 		goto fail;
 
+	if (q->threshold_mode == QUIRC_THRESHOLD_ADAPTIVE) {
+		integral = integral_alloc(w, h);
+		if (!integral)
+			goto fail;
+	}
+
 	/* alloc succeeded, update `q` with the new size and buffers */
 	q->w = w;
 	q->h = h;
 	free(q->image);
 	q->image = image;
-	if (!QUIRC_PIXEL_ALIAS_IMAGE) {
-		free(q->pixels);
-		q->pixels = pixels;
+	free(q->bits);
+	q->bits = bits;
+	q->stride = stride;
+	free(q->row_runs);
+	q->row_runs = row_runs;
+	free(q->bands[0].runs);
+	q->bands[0].runs = runs;
+	q->bands[0].num_runs = 0;
+	q->bands[0].max_runs = max_runs;
+	free(q->bands[0].components);
+	q->bands[0].components = components;
+	q->bands[0].num_components = 0;
+	q->bands[0].max_components = max_components;
+	free(q->spans);
+	q->spans = spans;
+	q->num_spans = 0;
+	q->max_spans = max_spans;
+	free(q->threshold_row);
+	q->threshold_row = threshold_row;
+	if (q->threshold_mode == QUIRC_THRESHOLD_ADAPTIVE) {
+		free(q->integral);
+		q->integral = integral;
 	}
-	free(q->flood_fill_vars);
-	q->flood_fill_vars = vars;
-	q->num_flood_fill_vars = num_vars;
+	q->video_level = -1;
 
 	return 0;
 	/* NOTREACHED */
 fail:
 	free(image);
-	free(pixels);
-	free(vars);
+	free(bits);
+	free(row_runs);
+	free(runs);
+	free(components);
+	free(spans);
+	free(threshold_row);
+	free(integral);
 
 	return -1;
 }
 
+int quirc_set_threshold_mode(struct quirc *q, quirc_threshold_mode_t mode)
+{
+	switch (mode) {
+	case QUIRC_THRESHOLD_GLOBAL:
+		free(q->integral);
+		q->integral = NULL;
+		break;
+
+	case QUIRC_THRESHOLD_ADAPTIVE:
+		if (!q->integral) {
+			q->integral = integral_alloc(q->w, q->h);
+			if (!q->integral)
+				return -1;
+		}
+		break;
+
+	default:
+		return -1;
+	}
+
+	q->threshold_mode = mode;
+	return 0;
+}
+
+void quirc_set_video_mode(struct quirc *q, int enable)
+{
+	q->video_mode = enable;
+	q->video_level = -1;
+}
+
+int quirc_set_threads(struct quirc *q, int threads)
+{
+	struct quirc_band *bands;
+	int i;
+
+	if (threads < 1)
+		return -1;
+#ifndef QUIRC_THREADS
+	if (threads > 1)
+		return -1;
+#endif
+
+	if (threads <= q->num_threads) {
+		for (i = threads; i < q->num_threads; i++)
+			band_free(&q->bands[i], 0);
+
+		q->num_threads = threads;
+		return 0;
+	}
+
+	bands = realloc(q->bands, sizeof(*bands) * threads);
+	if (!bands)
+		return -1;
+
+	for (i = q->num_threads; i < threads; i++)
+		memset(&bands[i], 0, sizeof(bands[i]));
+
+	q->bands = bands;
+	q->num_threads = threads;
+	return 0;
+}
+
+int quirc_set_min_module_size(struct quirc *q, int pixels)
+{
+	if (pixels < 1)
+		return -1;
+
+	q->scan_stride = pixels;
+	return 0;
+}
+
+int quirc_set_rois(struct quirc *q, const struct quirc_rect *rects,
+		   int count)
+{
+	struct quirc_rect *rois;
+	int i;
+
+	if (count < 0)
+		return -1;
+
+	for (i = 0; i < count; i++)
+		if (rects[i].w <= 0 || rects[i].h <= 0)
+			return -1;
+
+	if (!count) {
+		free(q->rois);
+		q->rois = NULL;
+		q->num_rois = 0;
+		return 0;
+	}
+
+	rois = malloc(sizeof(*rois) * count);
+	if (!rois)
+		return -1;
+
+	memcpy(rois, rects, sizeof(*rois) * count);
+	quirc_sort_rects(rois, count);
+
+	free(q->rois);
+	q->rois = rois;
+	q->num_rois = count;
+	return 0;
+}
+
+int quirc_set_pyramid(struct quirc *q, int factor)
+{
+	switch (factor) {
+	case 1:
+		q->pyramid = 0;
+		break;
+
+	case 2:
+		q->pyramid = 1;
+		break;
+
+	case 4:
+		q->pyramid = 2;
+		break;
+
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+int quirc_set_limits(struct quirc *q, int max_regions, int max_capstones,
+		     int max_grids)
+{
+	if (max_regions <= 0 || max_capstones <= 0 || max_grids <= 0)
+		return -1;
+
+	q->region_limit = max_regions;
+	q->capstone_limit = max_capstones;
+	q->grid_limit = max_grids;
+	return 0;
+}
+
 int quirc_count(const struct quirc *q)
 {
 	return q->num_grids;
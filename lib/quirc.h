@@ -56,12 +56,145 @@ int quirc_resize(struct quirc *q, int w, int h);
 uint8_t *quirc_begin(struct quirc *q, int *w, int *h);
 void quirc_end(struct quirc *q);
 
+/* If the image has already been converted to black and white, use
+ * quirc_begin_binary() instead of quirc_begin(). Each byte of the buffer
+ * must then be set to 1 for a black pixel or 0 for a white one, and
+ * quirc_end() skips thresholding altogether.
+ */
+uint8_t *quirc_begin_binary(struct quirc *q, int *w, int *h);
+
+/* These functions may be called instead of quirc_end() after filling
+ * a grayscale image obtained from quirc_begin(), if the caller already
+ * knows the threshold to use, or a histogram of the image. Pixels with
+ * values strictly below the threshold are black.
+ *
+ * The histogram has 256 bins, counting the pixels of each value. It
+ * need not cover every pixel of the image; a sample is fine. The
+ * threshold mode set by quirc_set_threshold_mode() and video mode are
+ * both ignored.
+ */
+void quirc_end_with_threshold(struct quirc *q, uint8_t threshold);
+void quirc_end_with_histogram(struct quirc *q, const unsigned int *histogram);
+
+/* This enum describes the methods which quirc_end() may use to decide
+ * which pixels of the input image are black.
+ */
+typedef enum {
+	/* A single threshold for the whole image, chosen by Otsu's
+	 * method. This is the default.
+	 */
+	QUIRC_THRESHOLD_GLOBAL = 0,
+
+	/* Each pixel is compared against the mean brightness of the
+	 * surrounding area, less a bias which follows the local
+	 * contrast. This copes with glare and shadows across the
+	 * image, at some extra cost per frame.
+	 */
+	QUIRC_THRESHOLD_ADAPTIVE
+} quirc_threshold_mode_t;
+
+/* Select the thresholding method used by subsequent calls to
+ * quirc_end().
+ *
+ * This function returns 0 on success, or -1 if the mode is unknown or
+ * sufficient memory could not be allocated. On failure, the previous
+ * mode is kept.
+ */
+int quirc_set_threshold_mode(struct quirc *q, quirc_threshold_mode_t mode);
+
+/* Enable or disable video mode. In video mode, quirc assumes that
+ * successive images come from the same camera, and that lighting
+ * changes slowly from one to the next. The global threshold is then
+ * estimated from a sample of each image and smoothed over time, rather
+ * than computed from scratch for every frame. Large changes are still
+ * picked up immediately.
+ *
+ * Video mode has no effect on QUIRC_THRESHOLD_ADAPTIVE.
+ */
+void quirc_set_video_mode(struct quirc *q, int enable);
+
+/* Set the largest number of regions (connected areas of black pixels),
+ * capstones and grids which quirc_end() will keep track of in a single
+ * image. Anything found beyond these limits is ignored. The tables
+ * start small and grow as needed, so generous limits only cost memory
+ * for images which use them.
+ *
+ * The defaults (252 regions, 32 capstones and 64 grids) suit a camera
+ * frame with a few codes in it. Dense scenes need higher limits: with
+ * the defaults, no more than ten codes can be found in one image, and
+ * large or cluttered images run out of regions before every capstone
+ * has been seen.
+ *
+ * This function returns 0 on success, or -1 if any limit is not
+ * positive, in which case the previous limits are kept.
+ */
+int quirc_set_limits(struct quirc *q, int max_regions, int max_capstones,
+		     int max_grids);
+
+/* Set the number of threads quirc_end() may use. The image is split
+ * into horizontal bands, which are thresholded and scanned in parallel
+ * before being stitched back together. The results are the same as with
+ * a single thread, which is the default.
+ *
+ * This function returns 0 on success, or -1 if the number is not
+ * positive, sufficient memory could not be allocated, or threads are
+ * not supported on this platform. On failure, the previous setting is
+ * kept.
+ */
+int quirc_set_threads(struct quirc *q, int threads);
+
+/* Declare that no QR-code module in the image will be smaller than the
+ * given number of pixels. Finder patterns are then searched for on
+ * only one row in that many, and the rows skipped are scanned only
+ * around the patterns found. Codes with smaller modules may be missed.
+ * The default is 1, which scans every row.
+ *
+ * This function returns 0 on success, or -1 if the size is not
+ * positive.
+ */
+int quirc_set_min_module_size(struct quirc *q, int pixels);
+
+/* Look for codes in a copy of the image scaled down by the given
+ * factor, which may be 1 (the default), 2 or 4. Codes found there are
+ * scaled back up, fitted to the full image and read from it. Only the
+ * areas around capstones which couldn't be grouped into a code are
+ * scanned again at full resolution. Codes whose modules are narrower
+ * than about factor pixels may be missed.
+ *
+ * This function returns 0 on success, or -1 if the factor is not
+ * supported.
+ */
+int quirc_set_pyramid(struct quirc *q, int factor);
+
 /* This structure describes a location in the input image buffer. */
 struct quirc_point {
 	int	x;
 	int	y;
 };
 
+/* This structure describes a rectangle in the input image buffer. */
+struct quirc_rect {
+	int	x;
+	int	y;
+	int	w;
+	int	h;
+};
+
+/* Restrict quirc_end() to the given regions of interest. Only pixels
+ * inside at least one of the rectangles are looked at: the threshold is
+ * chosen from them, and everything outside is treated as white, so
+ * codes must lie entirely within a rectangle to be found. Rectangles
+ * are clipped to the image, and may overlap. The rectangles are copied.
+ * Pass a count of zero to scan the whole image again, which is the
+ * default.
+ *
+ * This function returns 0 on success, or -1 if a rectangle has no
+ * area or sufficient memory could not be allocated, in which case the
+ * previous regions are kept.
+ */
+int quirc_set_rois(struct quirc *q, const struct quirc_rect *rects,
+		   int count);
+
 /* This enum describes the various decoder errors which may occur. */
 typedef enum {
 	QUIRC_SUCCESS = 0,
@@ -22,30 +22,42 @@
 
 #include "quirc.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define QUIRC_ASSERT(a)	assert(a)
 
+/* quirc_end() can split its work across threads where POSIX threads are
+ * available, unless QUIRC_DISABLE_THREADS is defined.
+ */
+#if !defined(QUIRC_DISABLE_THREADS) && \
+	(defined(__unix__) || defined(__APPLE__))
+#define QUIRC_THREADS
+#endif
+
+/* Pixel values, as returned by quirc_pixel(). Values from
+ * QUIRC_PIXEL_REGION upwards are region labels.
+ */
 #define QUIRC_PIXEL_WHITE	0
 #define QUIRC_PIXEL_BLACK	1
 #define QUIRC_PIXEL_REGION	2
 
+/* Default limits for quirc_set_limits(). QUIRC_MAX_REGIONS counts the
+ * reserved pixel values too.
+ */
 #ifndef QUIRC_MAX_REGIONS
 #define QUIRC_MAX_REGIONS	254
 #endif
+#ifndef QUIRC_MAX_CAPSTONES
 #define QUIRC_MAX_CAPSTONES	32
+#endif
+#ifndef QUIRC_MAX_GRIDS
 #define QUIRC_MAX_GRIDS		(QUIRC_MAX_CAPSTONES * 2)
+#endif
 
 #define QUIRC_PERSPECTIVE_PARAMS	8
 
-#if QUIRC_MAX_REGIONS < UINT8_MAX
-#define QUIRC_PIXEL_ALIAS_IMAGE	1
-typedef uint8_t quirc_pixel_t;
-#elif QUIRC_MAX_REGIONS < UINT16_MAX
-#define QUIRC_PIXEL_ALIAS_IMAGE	0
-typedef uint16_t quirc_pixel_t;
-#else
-#error "QUIRC_MAX_REGIONS > 65534 is not supported"
-#endif
-
 #ifdef QUIRC_FLOAT_TYPE
 /* Quirc uses double precision floating point internally by default.
  * On platforms with a single precision FPU but no double precision FPU,
@@ -64,16 +76,41 @@ struct quirc_region {
 	struct quirc_point	seed;
 	int			count;
 	int			capstone;
+	int			component;
+
+	/* The region's runs, copied into the span arena */
+	int			first_span;
+	int			num_spans;
+
+	/* Bounding box, centroid and the x and y second-order central
+	 * moments (normalized by area), gathered as the runs are copied.
+	 */
+	int			left;
+	int			top;
+	int			right;
+	int			bottom;
+	quirc_float_t		cx;
+	quirc_float_t		cy;
+	quirc_float_t		mu20;
+	quirc_float_t		mu02;
 };
 
 struct quirc_capstone {
 	int			ring;
 	int			stone;
 
+	/* Until the capstone is located, only the center is known, and
+	 * that only roughly: it's the centroid of the ring.
+	 */
+	int			located;
 	struct quirc_point	corners[4];
 	struct quirc_point	center;
 	quirc_float_t		c[QUIRC_PERSPECTIVE_PARAMS];
 
+	/* Centroid of the stone, to sub-pixel precision */
+	quirc_float_t		stone_x;
+	quirc_float_t		stone_y;
+
 	int			qr_grid;
 };
 
@@ -93,32 +130,378 @@ struct quirc_grid {
 	quirc_float_t		c[QUIRC_PERSPECTIVE_PARAMS];
 };
 
-struct quirc_flood_fill_vars {
-	int y;
-	int right;
-	int left_up;
-	int left_down;
+/* The sum of the pixels of a block, their number and the sum of their
+ * squares. In the summed-area table used by adaptive thresholding, sums
+ * and counts are kept modulo 2^32, as a window's always fit in 32 bits,
+ * but the sums of squares may not.
+ */
+struct quirc_block_sum {
+	uint32_t		sum;
+	uint32_t		count;
+	uint64_t		sum_sq;
+};
+
+/* Per-CPU implementations of the hot per-pixel loops, selected once
+ * when the decoder is constructed. See threshold.c.
+ */
+typedef void (*quirc_binarize_func_t)(const uint8_t *src,
+				      const uint8_t *threshold,
+				      uint64_t *dst, size_t len);
+typedef void (*quirc_block_sums_func_t)(const uint8_t *src, size_t len,
+					struct quirc_block_sum *acc);
+typedef void (*quirc_decimate_func_t)(const uint8_t *src, size_t w,
+				      int shift, uint8_t *dst, size_t n);
+typedef void (*quirc_map_points_func_t)(const float *c,
+					const float *u, const float *v,
+					int32_t *x, int32_t *y, size_t n);
+typedef void (*quirc_map_row_func_t)(const float *c, float u, float v,
+				     int32_t *x, int32_t *y, size_t n);
+
+struct quirc_kernels {
+	quirc_binarize_func_t	binarize;
+	quirc_block_sums_func_t	block_sums;
+	quirc_decimate_func_t	decimate;
+	quirc_map_points_func_t	map_points;
+	quirc_map_row_func_t	map_row;
+};
+
+/* Points mapped by the map_points kernel are clamped to this distance
+ * from the origin, so that they always convert to integers.
+ */
+#define QUIRC_MAP_LIMIT			(1 << 30)
+
+/* The map_row kernel steps the transform from one point to the next,
+ * going back to the exact value every this many points so that
+ * rounding errors can't build up. It must be a multiple of 8.
+ */
+#define QUIRC_MAP_ANCHOR		16
+
+/* Adaptive thresholding works on square blocks of this many pixels
+ * across. The SIMD block sum kernels assume a value of 8.
+ */
+#define QUIRC_THRESHOLD_BLOCK		8
+#define QUIRC_THRESHOLD_BLOCK_SHIFT	3
+
+/* Adaptive thresholding compares each pixel against the mean of its
+ * neighbourhood, less a bias. On flat areas, that's this percentage of
+ * the mean. Where the standard deviation reaches QUIRC_ADAPTIVE_CONTRAST
+ * grey levels, it's a quarter of the standard deviation, up to the same
+ * limit.
+ */
+#define QUIRC_ADAPTIVE_BIAS		15
+#define QUIRC_ADAPTIVE_CONTRAST		24
+
+/* In video mode, the threshold estimate is taken from every Nth row. If
+ * it differs from the running threshold by more than the maximum drift,
+ * the threshold is recomputed from the whole frame. The running
+ * threshold is kept in fixed point with this many fractional bits.
+ */
+#define QUIRC_VIDEO_ROW_STRIDE		4
+#define QUIRC_VIDEO_MAX_DRIFT		8
+#define QUIRC_VIDEO_LEVEL_SHIFT		4
+
+/* A capstone which might be next to another in a grid, the distance
+ * between them (negative on one side), and the number of others nearer
+ * on the same side.
+ */
+struct quirc_neighbour {
+	int			index;
+	quirc_float_t		distance;
+	int			nearer;
+};
+
+/* Three capstones which may make up a grid, the corner one second, and
+ * how far they are from the shape of one.
+ */
+struct quirc_grouping {
+	int			caps[3];
+	quirc_float_t		score;
+};
+
+/* A 1:1:3:1:1 run pattern found by finder_scan(), waiting for the rest
+ * of the image to be labelled before its regions can be looked up.
+ */
+struct quirc_candidate {
+	int			x;
+	int			y;
+	unsigned int		pb[5];
+};
+
+/* A horizontal run of black pixels in row y, from left to right
+ * inclusive. Runs of the same connected component are chained together
+ * by next, which is -1 at the end of the list.
+ */
+struct quirc_run {
+	int			left;
+	int			right;
+	int			y;
+	int			component;
+	int			next;
+};
+
+/* A run of a region, as cached in the span arena. */
+struct quirc_span {
+	int			y;
+	int			left;
+	int			right;
+};
+
+/* A set of 4-connected black runs. Components are merged with a
+ * union-find as runs are extracted: only a component which is its own
+ * parent is live, and carries the statistics of all the runs merged
+ * into it. A component is promoted to a region (region >= 0) the first
+ * time region_code() looks it up.
+ */
+struct quirc_component {
+	int			parent;
+	int			count;
+	int			num_runs;
+	struct quirc_point	seed;
+	int			left;
+	int			top;
+	int			right;
+	int			bottom;
+	int			head;
+	int			tail;
+	int			region;
+};
+
+/* Bands of the image are never made smaller than this many rows. */
+#define QUIRC_BAND_MIN_ROWS		64
+
+/* Capstones found in a decimated image but not grouped into a grid are
+ * scanned at full resolution over an area this many times their size
+ * around them.
+ */
+#define QUIRC_PYRAMID_REACH		2
+
+/* Number of Gauss-Newton steps taken when fitting a grid's transform */
+#define QUIRC_FIT_ITERATIONS		4
+
+/* Capstones are indexed for grouping by the radius of their rings, in
+ * octaves: class k holds rings of radius less than 2 << k, except for
+ * the last, which holds everything larger. Each class is then divided
+ * into square cells of 1 << (k + QUIRC_CAPSTONE_CELL_SHIFT) pixels,
+ * which is wider than the distance at which capstones of that size can
+ * still pair.
+ */
+#define QUIRC_CAPSTONE_CLASSES		12
+#define QUIRC_CAPSTONE_CELL_SHIFT	8
+
+struct quirc_capstone_class {
+	int			shift;
+	int			cols;
+	int			rows;
+
+	/* Index of the class's first cell in capstone_cells */
+	int			first_cell;
+
+	/* Number of capstones, and the largest squared ring radius */
+	int			count;
+	quirc_float_t		max_r2;
+};
+
+/* Points sampled by the fitness score of a grid of a given size, in
+ * grid coordinates, with the score each adds if it is black: 1 or -1
+ * (white points score the opposite). Points are mapped in batches of
+ * QUIRC_LATTICE_BATCH, and the score is checked against its bound
+ * between batches.
+ */
+#define QUIRC_LATTICE_BATCH		256
+
+struct quirc_lattice {
+	int			grid_size;
+	int			count;
+
+	int			max_u;
+	float			*u;
+	int			max_v;
+	float			*v;
+	int			max_weight;
+	int8_t			*weight;
+};
+
+/* A horizontal band of the image, from first_row up to (but not
+ * including) last_row. While it is being labelled, its runs, components
+ * and row_runs entries are numbered from the start of the band, and
+ * row_runs is indexed by row relative to first_row.
+ */
+struct quirc_band {
+	int			first_row;
+	int			last_row;
+
+	int			*row_runs;
+	int			max_row_runs;
+	uint8_t			*threshold_row;
+	int			max_threshold_row;
+
+	int			num_runs;
+	int			max_runs;
+	struct quirc_run	*runs;
+
+	int			num_components;
+	int			max_components;
+	struct quirc_component	*components;
+
+	int			num_candidates;
+	int			max_candidates;
+	struct quirc_candidate	*candidates;
 };
 
 struct quirc {
 	uint8_t			*image;
-	quirc_pixel_t		*pixels;
 	int			w;
 	int			h;
 
+	/* The thresholded image, one bit per pixel (set for black), in
+	 * rows of stride words. The leftmost pixel of each word is in its
+	 * least significant bit.
+	 */
+	uint64_t		*bits;
+	int			stride;
+
+	/* Black runs of each row y, sorted from left to right, are
+	 * runs[row_runs[y]] to runs[row_runs[y + 1] - 1] of bands[0].
+	 */
+	int			*row_runs;
+
+	/* Bands of rows which are thresholded and labelled separately,
+	 * one per thread. Afterwards, they are all merged into bands[0],
+	 * whose run lists and components then cover the whole image.
+	 */
+	int			num_threads;
+	struct quirc_band	*bands;
+
+	/* The finder pattern search looks at every scan_stride-th row
+	 * first, then at the rows around any candidates it found.
+	 */
+	int			scan_stride;
+
+	/* Regions of interest, sorted by their left edges. If there are
+	 * none, the whole image is scanned.
+	 */
+	int			num_rois;
+	struct quirc_rect	*rois;
+
+	/* Decimated scanning. The image is first scanned at 1 / (1 <<
+	 * pyramid) of its size, in small_image. level is the shift of the
+	 * image currently being scanned, which the regions of interest
+	 * are scaled by. defer_refine is set while areas of the full image
+	 * are scanned.
+	 */
+	int			pyramid;
+	int			level;
+	int			defer_refine;
+	int			max_small_image;
+	uint8_t			*small_image;
+
+	/* Areas of the full image to scan after the decimated one */
+	int			max_boxes;
+	struct quirc_rect	*boxes;
+
+	/* Grids found in the decimated image, scaled up, and their
+	 * capstones, set aside while the full image is scanned.
+	 */
+	int			num_lifted_grids;
+	int			max_lifted_grids;
+	struct quirc_grid	*lifted_grids;
+	int			max_lifted_capstones;
+	struct quirc_capstone	*lifted_capstones;
+
+	/* The region, capstone and grid tables grow on demand, up to
+	 * their limits. Region numbers start at QUIRC_PIXEL_REGION.
+	 */
 	int			num_regions;
-	struct quirc_region	regions[QUIRC_MAX_REGIONS];
+	int			max_regions;
+	int			region_limit;
+	struct quirc_region	*regions;
+
+	/* Runs of each region, stored contiguously */
+	int			num_spans;
+	int			max_spans;
+	struct quirc_span	*spans;
 
 	int			num_capstones;
-	struct quirc_capstone	capstones[QUIRC_MAX_CAPSTONES];
+	int			max_capstones;
+	int			capstone_limit;
+	struct quirc_capstone	*capstones;
 
 	int			num_grids;
-	struct quirc_grid	grids[QUIRC_MAX_GRIDS];
+	int			max_grids;
+	int			grid_limit;
+	struct quirc_grid	*grids;
+
+	/* Spatial index of capstones. Each cell holds the head of a list
+	 * of capstones, linked through capstone_next in index order.
+	 * Partners of one capstone are gathered in capstone_partners,
+	 * and those lined up with it in capstone_neighbours. Groupings
+	 * holds the candidate grids of a frame.
+	 */
+	struct quirc_capstone_class capstone_classes[QUIRC_CAPSTONE_CLASSES];
+	int			max_capstone_cells;
+	int			*capstone_cells;
+	int			max_capstone_next;
+	int			*capstone_next;
+	int			max_capstone_partners;
+	int			*capstone_partners;
+	int			max_capstone_neighbours;
+	struct quirc_neighbour	*capstone_neighbours;
+	int			num_groupings;
+	int			max_groupings;
+	struct quirc_grouping	*groupings;
+
+	/* Fitness samples for the size of grid last scored */
+	struct quirc_lattice	lattice;
+
+	struct quirc_kernels	kernels;
+
+	quirc_threshold_mode_t	threshold_mode;
+	uint8_t			*threshold_row;
+	struct quirc_block_sum	*integral;
 
-	size_t      		num_flood_fill_vars;
-	struct quirc_flood_fill_vars *flood_fill_vars;
+	/* Video mode, and its running threshold in fixed point (or -1 if
+	 * there is none yet).
+	 */
+	int			video_mode;
+	int			video_level;
+
+	/* Set if the current image came from quirc_begin_binary() */
+	int			binary;
+
+	/* Set if the threshold was given to quirc_end_with_threshold() */
+	int			fixed_threshold;
 };
 
+/************************************************************************
+ * Thresholding and mapping kernels
+ */
+
+void quirc_select_kernels(struct quirc_kernels *k);
+void quirc_histogram(const uint8_t *src, size_t len, size_t rows,
+		     size_t step, unsigned int *histogram);
+
+/************************************************************************
+ * Regions of interest
+ */
+
+void quirc_sort_rects(struct quirc_rect *rects, int count);
+
+/************************************************************************
+ * Pixel access
+ */
+
+static inline int quirc_is_black(const struct quirc *q, int x, int y)
+{
+	const uint64_t *row = q->bits + (size_t)y * q->stride;
+
+	return (row[x >> 6] >> (x & 63)) & 1;
+}
+
+/* Return the value of the pixel at (x, y): white, black, or the label
+ * of the region it has been assigned to.
+ */
+int quirc_pixel(const struct quirc *q, int x, int y);
+
 /************************************************************************
  * QR-code version information database
  */
@@ -140,4 +523,8 @@ struct quirc_version_info {
 
 extern const struct quirc_version_info quirc_version_db[QUIRC_MAX_VERSION + 1];
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
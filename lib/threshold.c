@@ -0,0 +1,749 @@
+/* quirc -- QR-code recognition library
+ * Copyright (C) 2010-2012 Daniel Beer <dlbeer@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include <math.h>
+#include "quirc_internal.h"
+
+#ifndef QUIRC_DISABLE_SIMD
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QUIRC_X86_KERNELS
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define QUIRC_NEON_KERNELS
+#include <arm_neon.h>
+#endif
+#endif
+
+/************************************************************************
+ * Histogram
+ *
+ * Consecutive pixels very often have the same value, and incrementing
+ * the same counter back-to-back makes every increment wait for the
+ * previous store to retire. Spreading the pixels over four
+ * sub-histograms breaks that dependency chain. There is no useful
+ * vector scatter-increment on the targets we care about, so this
+ * kernel is shared by all of them.
+ *
+ * The counts of len pixels from each of rows rows, step bytes apart,
+ * are added to the histogram, so that a sample of rows costs a single
+ * pass over the sub-histograms.
+ */
+
+void quirc_histogram(const uint8_t *src, size_t len, size_t rows,
+		     size_t step, unsigned int *histogram)
+{
+	unsigned int sub[4][UINT8_MAX + 1];
+	size_t i;
+	int v;
+
+	memset(sub, 0, sizeof(sub));
+
+	for (; rows; rows--, src += step) {
+		for (i = 0; i + 4 <= len; i += 4) {
+			sub[0][src[i]]++;
+			sub[1][src[i + 1]]++;
+			sub[2][src[i + 2]]++;
+			sub[3][src[i + 3]]++;
+		}
+
+		for (; i < len; i++)
+			sub[0][src[i]]++;
+	}
+
+	for (v = 0; v <= UINT8_MAX; v++)
+		histogram[v] += sub[0][v] + sub[1][v] + sub[2][v] + sub[3][v];
+}
+
+/************************************************************************
+ * Decimation
+ *
+ * Scale n pixels down by 2 or 4 (a shift of 1 or 2) in each direction,
+ * averaging each square of source pixels. src is the first pixel of
+ * the first of the rows, which are w bytes apart. Averages are rounded,
+ * so that a binary image stays binary.
+ */
+
+static void decimate_scalar(const uint8_t *src, size_t w, int shift,
+			    uint8_t *dst, size_t n)
+{
+	const int size = 1 << shift;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		const uint8_t *p = src + (i << shift);
+		unsigned int sum = 0;
+		int x, y;
+
+		for (y = 0; y < size; y++, p += w)
+			for (x = 0; x < size; x++)
+				sum += p[x];
+
+		dst[i] = (sum + (1u << (shift * 2 - 1))) >> (shift * 2);
+	}
+}
+
+/************************************************************************
+ * Binarization
+ *
+ * Each kernel packs one row of the image into bits, 64 pixels per word
+ * with the leftmost pixel in the least significant bit. A bit is set
+ * (black) if the source value is below the corresponding entry of the
+ * threshold row. Bits past the end of the row are cleared.
+ */
+
+static void binarize_scalar(const uint8_t *src, const uint8_t *threshold,
+			    uint64_t *dst, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i += 64) {
+		const size_t n = len - i < 64 ? len - i : 64;
+		uint64_t word = 0;
+		size_t j;
+
+		for (j = 0; j < n; j++)
+			if (src[i + j] < threshold[i + j])
+				word |= (uint64_t)1 << j;
+
+		*dst++ = word;
+	}
+}
+
+/************************************************************************
+ * Block sums
+ *
+ * Add the sum of each group of QUIRC_THRESHOLD_BLOCK consecutive
+ * source pixels, their number and the sum of their squares, to the
+ * corresponding accumulator. len need not be a multiple of the block size.
+ */
+
+static void block_sums_scalar(const uint8_t *src, size_t len,
+			      struct quirc_block_sum *acc)
+{
+	while (len) {
+		size_t n = len < QUIRC_THRESHOLD_BLOCK ?
+			len : QUIRC_THRESHOLD_BLOCK;
+		uint32_t sum = 0;
+		uint32_t sum_sq = 0;
+
+		len -= n;
+		acc->count += n;
+		while (n--) {
+			sum += *src;
+			sum_sq += *src * *src;
+			src++;
+		}
+
+		acc->sum += sum;
+		acc->sum_sq += sum_sq;
+		acc++;
+	}
+}
+
+/************************************************************************
+ * Perspective mapping
+ *
+ * Map a batch of grid coordinates through the eight-parameter
+ * transform c, as perspective_map() does one point at a time, rounding
+ * to the nearest pixel. Single precision is plenty for coordinates of
+ * a few thousand pixels. Results are clamped to QUIRC_MAP_LIMIT, and
+ * points at infinity (or NaN) go to the negative limit, so that the
+ * caller's bounds check rejects them.
+ */
+
+static inline int32_t round_coord(float p)
+{
+	if (!(p > (float)-QUIRC_MAP_LIMIT))
+		p = (float)-QUIRC_MAP_LIMIT;
+	if (p > (float)QUIRC_MAP_LIMIT)
+		p = (float)QUIRC_MAP_LIMIT;
+
+	return (int32_t)rintf(p);
+}
+
+static void map_points_scalar(const float *c, const float *u, const float *v,
+			      int32_t *x, int32_t *y, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		const float den = c[6] * u[i] + c[7] * v[i] + 1.0f;
+
+		x[i] = round_coord((c[0] * u[i] + c[1] * v[i] + c[2]) / den);
+		y[i] = round_coord((c[3] * u[i] + c[4] * v[i] + c[5]) / den);
+	}
+}
+
+/* Map the points (u + i, v) for i < n. Along the row, the numerators
+ * and the denominator of the transform are affine in u, so they are
+ * stepped from one point to the next rather than computed afresh.
+ */
+static void map_row_scalar(const float *c, float u, float v,
+			   int32_t *x, int32_t *y, size_t n)
+{
+	float nx = 0.0f;
+	float ny = 0.0f;
+	float den = 1.0f;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (!(i % QUIRC_MAP_ANCHOR)) {
+			const float p = u + i;
+
+			nx = c[0] * p + c[1] * v + c[2];
+			ny = c[3] * p + c[4] * v + c[5];
+			den = c[6] * p + c[7] * v + 1.0f;
+		}
+
+		x[i] = round_coord(nx / den);
+		y[i] = round_coord(ny / den);
+
+		nx += c[0];
+		ny += c[3];
+		den += c[6];
+	}
+}
+
+#ifdef QUIRC_X86_KERNELS
+/* There is no unsigned byte comparison before AVX-512, so both sides
+ * are biased into the signed range first.
+ */
+__attribute__((target("sse2")))
+static void binarize_sse2(const uint8_t *src, const uint8_t *threshold,
+			  uint64_t *dst, size_t len)
+{
+	const __m128i bias = _mm_set1_epi8((char)0x80);
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		uint64_t word = 0;
+		int j;
+
+		for (j = 0; j < 64; j += 16) {
+			__m128i v = _mm_loadu_si128(
+				(const __m128i *)(src + i + j));
+			__m128i t = _mm_loadu_si128(
+				(const __m128i *)(threshold + i + j));
+			__m128i m = _mm_cmpgt_epi8(_mm_xor_si128(t, bias),
+						   _mm_xor_si128(v, bias));
+
+			word |= (uint64_t)(uint16_t)_mm_movemask_epi8(m) << j;
+		}
+
+		*dst++ = word;
+	}
+
+	binarize_scalar(src + i, threshold + i, dst, len - i);
+}
+
+/* Sum each pair of neighbouring bytes into a 16-bit lane. */
+__attribute__((target("sse2")))
+static inline __m128i pair_sums_sse2(__m128i v)
+{
+	const __m128i low = _mm_set1_epi16(0xff);
+
+	return _mm_add_epi16(_mm_and_si128(v, low), _mm_srli_epi16(v, 8));
+}
+
+__attribute__((target("sse2")))
+static void decimate_sse2(const uint8_t *src, size_t w, int shift,
+			  uint8_t *dst, size_t n)
+{
+	const __m128i low = _mm_set1_epi32(0xffff);
+	size_t i = 0;
+
+	if (shift == 1) {
+		const __m128i round = _mm_set1_epi16(2);
+
+		for (; i + 16 <= n; i += 16) {
+			const uint8_t *p = src + i * 2;
+			__m128i a = _mm_add_epi16(
+				pair_sums_sse2(_mm_loadu_si128(
+					(const __m128i *)p)),
+				pair_sums_sse2(_mm_loadu_si128(
+					(const __m128i *)(p + w))));
+			__m128i b = _mm_add_epi16(
+				pair_sums_sse2(_mm_loadu_si128(
+					(const __m128i *)(p + 16))),
+				pair_sums_sse2(_mm_loadu_si128(
+					(const __m128i *)(p + w + 16))));
+
+			a = _mm_srli_epi16(_mm_add_epi16(a, round), 2);
+			b = _mm_srli_epi16(_mm_add_epi16(b, round), 2);
+			_mm_storeu_si128((__m128i *)(dst + i),
+					 _mm_packus_epi16(a, b));
+		}
+	} else {
+		const __m128i round = _mm_set1_epi32(8);
+
+		for (; i + 8 <= n; i += 8) {
+			const uint8_t *p = src + i * 4;
+			__m128i a = _mm_setzero_si128();
+			__m128i b = _mm_setzero_si128();
+			int y;
+
+			for (y = 0; y < 4; y++, p += w) {
+				a = _mm_add_epi16(a, pair_sums_sse2(
+					_mm_loadu_si128((const __m128i *)p)));
+				b = _mm_add_epi16(b, pair_sums_sse2(
+					_mm_loadu_si128(
+						(const __m128i *)(p + 16))));
+			}
+
+			/* Then pairs of those into 32-bit lanes */
+			a = _mm_add_epi32(_mm_and_si128(a, low),
+					  _mm_srli_epi32(a, 16));
+			b = _mm_add_epi32(_mm_and_si128(b, low),
+					  _mm_srli_epi32(b, 16));
+			a = _mm_srli_epi32(_mm_add_epi32(a, round), 4);
+			b = _mm_srli_epi32(_mm_add_epi32(b, round), 4);
+			a = _mm_packs_epi32(a, b);
+			_mm_storel_epi64((__m128i *)(dst + i),
+					 _mm_packus_epi16(a, a));
+		}
+	}
+
+	decimate_scalar(src + (i << shift), w, shift, dst + i, n - i);
+}
+
+/* PSADBW against zero sums each 8-byte half of the register. PMADDWD
+ * squares the pixels, once widened, and adds them in pairs.
+ */
+__attribute__((target("sse2")))
+static void block_sums_sse2(const uint8_t *src, size_t len,
+			    struct quirc_block_sum *acc)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i s = _mm_sad_epu8(v, zero);
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+		__m128i sq;
+
+		lo = _mm_madd_epi16(lo, lo);
+		hi = _mm_madd_epi16(hi, hi);
+		sq = _mm_add_epi32(_mm_unpacklo_epi64(lo, hi),
+				   _mm_unpackhi_epi64(lo, hi));
+		sq = _mm_add_epi32(sq, _mm_srli_epi64(sq, 32));
+
+		acc[0].sum += _mm_cvtsi128_si32(s);
+		acc[1].sum += _mm_extract_epi16(s, 4);
+		acc[0].count += QUIRC_THRESHOLD_BLOCK;
+		acc[1].count += QUIRC_THRESHOLD_BLOCK;
+		acc[0].sum_sq += (uint32_t)_mm_cvtsi128_si32(sq);
+		acc[1].sum_sq += (uint32_t)_mm_cvtsi128_si32(
+			_mm_unpackhi_epi64(sq, sq));
+		acc += 2;
+	}
+
+	block_sums_scalar(src + i, len - i, acc);
+}
+
+__attribute__((target("avx2")))
+static void binarize_avx2(const uint8_t *src, const uint8_t *threshold,
+			  uint64_t *dst, size_t len)
+{
+	const __m256i bias = _mm256_set1_epi8((char)0x80);
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		uint64_t word = 0;
+		int j;
+
+		for (j = 0; j < 64; j += 32) {
+			__m256i v = _mm256_loadu_si256(
+				(const __m256i *)(src + i + j));
+			__m256i t = _mm256_loadu_si256(
+				(const __m256i *)(threshold + i + j));
+			__m256i m = _mm256_cmpgt_epi8(
+				_mm256_xor_si256(t, bias),
+				_mm256_xor_si256(v, bias));
+
+			word |= (uint64_t)(uint32_t)
+				_mm256_movemask_epi8(m) << j;
+		}
+
+		*dst++ = word;
+	}
+
+	_mm256_zeroupper();
+	binarize_scalar(src + i, threshold + i, dst, len - i);
+}
+
+/* The conversions round to nearest, as rintf() does in the default
+ * rounding mode. MAXPS returns its second operand if either is NaN.
+ */
+__attribute__((target("sse2")))
+static void map_points_sse2(const float *c, const float *u, const float *v,
+			    int32_t *x, int32_t *y, size_t n)
+{
+	const __m128 min = _mm_set1_ps((float)-QUIRC_MAP_LIMIT);
+	const __m128 max = _mm_set1_ps((float)QUIRC_MAP_LIMIT);
+	const __m128 one = _mm_set1_ps(1.0f);
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		const __m128 vu = _mm_loadu_ps(u + i);
+		const __m128 vv = _mm_loadu_ps(v + i);
+		const __m128 den = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(_mm_set1_ps(c[6]), vu),
+			_mm_mul_ps(_mm_set1_ps(c[7]), vv)), one);
+		__m128 px = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(_mm_set1_ps(c[0]), vu),
+			_mm_mul_ps(_mm_set1_ps(c[1]), vv)), _mm_set1_ps(c[2]));
+		__m128 py = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(_mm_set1_ps(c[3]), vu),
+			_mm_mul_ps(_mm_set1_ps(c[4]), vv)), _mm_set1_ps(c[5]));
+
+		px = _mm_min_ps(_mm_max_ps(_mm_div_ps(px, den), min), max);
+		py = _mm_min_ps(_mm_max_ps(_mm_div_ps(py, den), min), max);
+
+		_mm_storeu_si128((__m128i *)(x + i), _mm_cvtps_epi32(px));
+		_mm_storeu_si128((__m128i *)(y + i), _mm_cvtps_epi32(py));
+	}
+
+	map_points_scalar(c, u + i, v + i, x + i, y + i, n - i);
+}
+
+/* Each lane steps its own point, four cells apart */
+__attribute__((target("sse2")))
+static void map_row_sse2(const float *c, float u, float v,
+			 int32_t *x, int32_t *y, size_t n)
+{
+	const __m128 min = _mm_set1_ps((float)-QUIRC_MAP_LIMIT);
+	const __m128 max = _mm_set1_ps((float)QUIRC_MAP_LIMIT);
+	const __m128 lanes = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+	const __m128 dx = _mm_set1_ps(c[0] * 4.0f);
+	const __m128 dy = _mm_set1_ps(c[3] * 4.0f);
+	const __m128 dd = _mm_set1_ps(c[6] * 4.0f);
+	__m128 nx = _mm_setzero_ps();
+	__m128 ny = _mm_setzero_ps();
+	__m128 den = _mm_setzero_ps();
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128 px, py;
+
+		if (!(i % QUIRC_MAP_ANCHOR)) {
+			const __m128 p = _mm_add_ps(_mm_set1_ps(u + i), lanes);
+
+			nx = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(c[0]), p),
+					_mm_set1_ps(c[1] * v + c[2]));
+			ny = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(c[3]), p),
+					_mm_set1_ps(c[4] * v + c[5]));
+			den = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(c[6]), p),
+					 _mm_set1_ps(c[7] * v + 1.0f));
+		}
+
+		px = _mm_min_ps(_mm_max_ps(_mm_div_ps(nx, den), min), max);
+		py = _mm_min_ps(_mm_max_ps(_mm_div_ps(ny, den), min), max);
+
+		_mm_storeu_si128((__m128i *)(x + i), _mm_cvtps_epi32(px));
+		_mm_storeu_si128((__m128i *)(y + i), _mm_cvtps_epi32(py));
+
+		nx = _mm_add_ps(nx, dx);
+		ny = _mm_add_ps(ny, dy);
+		den = _mm_add_ps(den, dd);
+	}
+
+	map_row_scalar(c, u + i, v, x + i, y + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void map_points_avx2(const float *c, const float *u, const float *v,
+			    int32_t *x, int32_t *y, size_t n)
+{
+	const __m256 min = _mm256_set1_ps((float)-QUIRC_MAP_LIMIT);
+	const __m256 max = _mm256_set1_ps((float)QUIRC_MAP_LIMIT);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		const __m256 vu = _mm256_loadu_ps(u + i);
+		const __m256 vv = _mm256_loadu_ps(v + i);
+		const __m256 den = _mm256_add_ps(_mm256_add_ps(
+			_mm256_mul_ps(_mm256_set1_ps(c[6]), vu),
+			_mm256_mul_ps(_mm256_set1_ps(c[7]), vv)), one);
+		__m256 px = _mm256_add_ps(_mm256_add_ps(
+			_mm256_mul_ps(_mm256_set1_ps(c[0]), vu),
+			_mm256_mul_ps(_mm256_set1_ps(c[1]), vv)),
+			_mm256_set1_ps(c[2]));
+		__m256 py = _mm256_add_ps(_mm256_add_ps(
+			_mm256_mul_ps(_mm256_set1_ps(c[3]), vu),
+			_mm256_mul_ps(_mm256_set1_ps(c[4]), vv)),
+			_mm256_set1_ps(c[5]));
+
+		px = _mm256_min_ps(_mm256_max_ps(_mm256_div_ps(px, den), min),
+				   max);
+		py = _mm256_min_ps(_mm256_max_ps(_mm256_div_ps(py, den), min),
+				   max);
+
+		_mm256_storeu_si256((__m256i *)(x + i),
+				    _mm256_cvtps_epi32(px));
+		_mm256_storeu_si256((__m256i *)(y + i),
+				    _mm256_cvtps_epi32(py));
+	}
+
+	_mm256_zeroupper();
+	map_points_scalar(c, u + i, v + i, x + i, y + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void map_row_avx2(const float *c, float u, float v,
+			 int32_t *x, int32_t *y, size_t n)
+{
+	const __m256 min = _mm256_set1_ps((float)-QUIRC_MAP_LIMIT);
+	const __m256 max = _mm256_set1_ps((float)QUIRC_MAP_LIMIT);
+	const __m256 lanes = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f,
+					    4.0f, 5.0f, 6.0f, 7.0f);
+	const __m256 dx = _mm256_set1_ps(c[0] * 8.0f);
+	const __m256 dy = _mm256_set1_ps(c[3] * 8.0f);
+	const __m256 dd = _mm256_set1_ps(c[6] * 8.0f);
+	__m256 nx = _mm256_setzero_ps();
+	__m256 ny = _mm256_setzero_ps();
+	__m256 den = _mm256_setzero_ps();
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256 px, py;
+
+		if (!(i % QUIRC_MAP_ANCHOR)) {
+			const __m256 p = _mm256_add_ps(_mm256_set1_ps(u + i),
+						       lanes);
+
+			nx = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(c[0]),
+							 p),
+					   _mm256_set1_ps(c[1] * v + c[2]));
+			ny = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(c[3]),
+							 p),
+					   _mm256_set1_ps(c[4] * v + c[5]));
+			den = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(c[6]),
+							  p),
+					    _mm256_set1_ps(c[7] * v + 1.0f));
+		}
+
+		px = _mm256_min_ps(_mm256_max_ps(_mm256_div_ps(nx, den), min),
+				   max);
+		py = _mm256_min_ps(_mm256_max_ps(_mm256_div_ps(ny, den), min),
+				   max);
+
+		_mm256_storeu_si256((__m256i *)(x + i),
+				    _mm256_cvtps_epi32(px));
+		_mm256_storeu_si256((__m256i *)(y + i),
+				    _mm256_cvtps_epi32(py));
+
+		nx = _mm256_add_ps(nx, dx);
+		ny = _mm256_add_ps(ny, dy);
+		den = _mm256_add_ps(den, dd);
+	}
+
+	_mm256_zeroupper();
+	map_row_scalar(c, u + i, v, x + i, y + i, n - i);
+}
+#endif
+
+#ifdef QUIRC_NEON_KERNELS
+/* NEON has no movemask: weight each byte of the comparison result by
+ * its bit position and add across each half with pairwise additions.
+ */
+static inline uint16_t movemask_neon(uint8x16_t m)
+{
+	static const uint8_t weights[16] = {
+		1, 2, 4, 8, 16, 32, 64, 128,
+		1, 2, 4, 8, 16, 32, 64, 128
+	};
+	uint8x16_t b = vandq_u8(m, vld1q_u8(weights));
+	uint8x8_t p = vpadd_u8(vget_low_u8(b), vget_high_u8(b));
+
+	p = vpadd_u8(p, p);
+	p = vpadd_u8(p, p);
+
+	return vget_lane_u8(p, 0) | (vget_lane_u8(p, 1) << 8);
+}
+
+static void binarize_neon(const uint8_t *src, const uint8_t *threshold,
+			  uint64_t *dst, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		uint64_t word = 0;
+		int j;
+
+		for (j = 0; j < 64; j += 16) {
+			uint8x16_t m = vcltq_u8(vld1q_u8(src + i + j),
+						vld1q_u8(threshold + i + j));
+
+			word |= (uint64_t)movemask_neon(m) << j;
+		}
+
+		*dst++ = word;
+	}
+
+	binarize_scalar(src + i, threshold + i, dst, len - i);
+}
+
+static void block_sums_neon(const uint8_t *src, size_t len,
+			    struct quirc_block_sum *acc)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		const uint8x16_t v = vld1q_u8(src + i);
+		uint64x2_t s = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(v)));
+		uint64x2_t lo = vpaddlq_u32(vpaddlq_u16(
+			vmull_u8(vget_low_u8(v), vget_low_u8(v))));
+		uint64x2_t hi = vpaddlq_u32(vpaddlq_u16(
+			vmull_u8(vget_high_u8(v), vget_high_u8(v))));
+
+		acc[0].sum += (uint32_t)vgetq_lane_u64(s, 0);
+		acc[1].sum += (uint32_t)vgetq_lane_u64(s, 1);
+		acc[0].count += QUIRC_THRESHOLD_BLOCK;
+		acc[1].count += QUIRC_THRESHOLD_BLOCK;
+		acc[0].sum_sq += vgetq_lane_u64(lo, 0) + vgetq_lane_u64(lo, 1);
+		acc[1].sum_sq += vgetq_lane_u64(hi, 0) + vgetq_lane_u64(hi, 1);
+		acc += 2;
+	}
+
+	block_sums_scalar(src + i, len - i, acc);
+}
+
+#ifdef __aarch64__
+/* Division and round-to-nearest conversion need AArch64. FMAX returns
+ * NaN if either operand is, so NaN is caught by comparison instead.
+ */
+static void map_points_neon(const float *c, const float *u, const float *v,
+			    int32_t *x, int32_t *y, size_t n)
+{
+	const float32x4_t min = vdupq_n_f32((float)-QUIRC_MAP_LIMIT);
+	const float32x4_t max = vdupq_n_f32((float)QUIRC_MAP_LIMIT);
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		const float32x4_t vu = vld1q_f32(u + i);
+		const float32x4_t vv = vld1q_f32(v + i);
+		const float32x4_t den = vaddq_f32(vaddq_f32(
+			vmulq_n_f32(vu, c[6]), vmulq_n_f32(vv, c[7])),
+			vdupq_n_f32(1.0f));
+		float32x4_t px = vaddq_f32(vaddq_f32(
+			vmulq_n_f32(vu, c[0]), vmulq_n_f32(vv, c[1])),
+			vdupq_n_f32(c[2]));
+		float32x4_t py = vaddq_f32(vaddq_f32(
+			vmulq_n_f32(vu, c[3]), vmulq_n_f32(vv, c[4])),
+			vdupq_n_f32(c[5]));
+
+		px = vdivq_f32(px, den);
+		py = vdivq_f32(py, den);
+		px = vbslq_f32(vcgtq_f32(px, min), vminq_f32(px, max), min);
+		py = vbslq_f32(vcgtq_f32(py, min), vminq_f32(py, max), min);
+
+		vst1q_s32(x + i, vcvtnq_s32_f32(px));
+		vst1q_s32(y + i, vcvtnq_s32_f32(py));
+	}
+
+	map_points_scalar(c, u + i, v + i, x + i, y + i, n - i);
+}
+
+static void map_row_neon(const float *c, float u, float v,
+			 int32_t *x, int32_t *y, size_t n)
+{
+	static const float offsets[4] = {0.0f, 1.0f, 2.0f, 3.0f};
+	const float32x4_t min = vdupq_n_f32((float)-QUIRC_MAP_LIMIT);
+	const float32x4_t max = vdupq_n_f32((float)QUIRC_MAP_LIMIT);
+	const float32x4_t lanes = vld1q_f32(offsets);
+	const float32x4_t dx = vdupq_n_f32(c[0] * 4.0f);
+	const float32x4_t dy = vdupq_n_f32(c[3] * 4.0f);
+	const float32x4_t dd = vdupq_n_f32(c[6] * 4.0f);
+	float32x4_t nx = vdupq_n_f32(0.0f);
+	float32x4_t ny = vdupq_n_f32(0.0f);
+	float32x4_t den = vdupq_n_f32(1.0f);
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		float32x4_t px, py;
+
+		if (!(i % QUIRC_MAP_ANCHOR)) {
+			const float32x4_t p = vaddq_f32(vdupq_n_f32(u + i),
+							lanes);
+
+			nx = vaddq_f32(vmulq_n_f32(p, c[0]),
+				       vdupq_n_f32(c[1] * v + c[2]));
+			ny = vaddq_f32(vmulq_n_f32(p, c[3]),
+				       vdupq_n_f32(c[4] * v + c[5]));
+			den = vaddq_f32(vmulq_n_f32(p, c[6]),
+					vdupq_n_f32(c[7] * v + 1.0f));
+		}
+
+		px = vdivq_f32(nx, den);
+		py = vdivq_f32(ny, den);
+		px = vbslq_f32(vcgtq_f32(px, min), vminq_f32(px, max), min);
+		py = vbslq_f32(vcgtq_f32(py, min), vminq_f32(py, max), min);
+
+		vst1q_s32(x + i, vcvtnq_s32_f32(px));
+		vst1q_s32(y + i, vcvtnq_s32_f32(py));
+
+		nx = vaddq_f32(nx, dx);
+		ny = vaddq_f32(ny, dy);
+		den = vaddq_f32(den, dd);
+	}
+
+	map_row_scalar(c, u + i, v, x + i, y + i, n - i);
+}
+#endif
+#endif
+
+/************************************************************************
+ * Kernel selection
+ */
+
+void quirc_select_kernels(struct quirc_kernels *k)
+{
+	k->binarize = binarize_scalar;
+	k->block_sums = block_sums_scalar;
+	k->decimate = decimate_scalar;
+	k->map_points = map_points_scalar;
+	k->map_row = map_row_scalar;
+
+#ifdef QUIRC_X86_KERNELS
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2")) {
+		k->binarize = binarize_sse2;
+		k->block_sums = block_sums_sse2;
+		k->decimate = decimate_sse2;
+		k->map_points = map_points_sse2;
+		k->map_row = map_row_sse2;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		k->binarize = binarize_avx2;
+		k->map_points = map_points_avx2;
+		k->map_row = map_row_avx2;
+	}
+#endif
+
+#ifdef QUIRC_NEON_KERNELS
+	k->binarize = binarize_neon;
+	k->block_sums = block_sums_neon;
+#ifdef __aarch64__
+	k->map_points = map_points_neon;
+	k->map_row = map_row_neon;
+#endif
+#endif
+}
@@ -0,0 +1,72 @@
+#!/bin/sh
+# quirc -- QR-code recognition library
+# Copyright (C) 2010-2012 Daniel Beer <dlbeer@gmail.com>
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Check that the options which only change how quirc_end() goes about its
+# work decode the same codes from the test images as a plain scan, in
+# both threshold modes, and that with regions of interest, nothing
+# outside them is looked at. No module in the test images is narrower
+# than 2 pixels, and the label sheet needs higher limits.
+
+QRTEST=./qrtest
+IMAGES=tests/images
+LIMITS=65532,256,256
+failed=0
+
+# The payloads decoded from each image, each after the image's name,
+# sorted so that the order in which codes are found doesn't matter.
+decodes() {
+	$QRTEST -l $LIMITS -v "$@" $IMAGES |
+		awk '/^  [^ ].*: *[0-9]/ { name = $1 }
+		     /^    Payload: / { print name, substr($0, 14) }' |
+		sort
+}
+
+# The corners and cells of every code found, in the order found.
+cells() {
+	$QRTEST -l $LIMITS -d "$@" $IMAGES | grep '^    '
+}
+
+check() {
+	if [ "$2" = "$3" ]; then
+		echo "ok: $1"
+	else
+		echo "FAILED: $1"
+		failed=1
+	fi
+}
+
+for mode in "" -a; do
+	plain=$(decodes $mode)
+	if [ -z "$plain" ]; then
+		echo "FAILED: nothing decoded $mode"
+		exit 1
+	fi
+
+	check "-t 4 $mode" "$plain" "$(decodes $mode -t 4)"
+	check "-m 2 $mode" "$plain" "$(decodes $mode -m 2)"
+	check "-p 2 $mode" "$plain" "$(decodes $mode -p 2)"
+	check "-r 0 $mode" "$plain" "$(decodes $mode -r 0)"
+	check "-t 4 -m 2 -p 2 -r 0 $mode" "$plain" \
+		"$(decodes $mode -t 4 -m 2 -p 2 -r 0)"
+
+	# Paint the outside of the regions of interest two ways
+	check "-r 0 against -r 255 $mode" \
+		"$(cells $mode -r 0)" "$(cells $mode -r 255)"
+	check "-p 2 -r 0 against -p 2 -r 255 $mode" \
+		"$(cells $mode -p 2 -r 0)" "$(cells $mode -p 2 -r 255)"
+done
+
+exit $failed
@@ -56,7 +56,6 @@ static void dump_info(struct quirc *q)
 static void draw_frame(SDL_Surface *screen, struct quirc *q)
 {
 	uint8_t *pix;
-	uint8_t *raw = q->image;
 	int x, y;
 
 	SDL_LockSurface(screen);
@@ -65,7 +64,7 @@ static void draw_frame(SDL_Surface *screen, struct quirc *q)
 		uint32_t *row = (uint32_t *)pix;
 
 		for (x = 0; x < q->w; x++) {
-			uint8_t v = *(raw++);
+			int v = quirc_pixel(q, x, y);
 			uint32_t color = (v << 16) | (v << 8) | v;
 			struct quirc_region *reg = &q->regions[v];
 
@@ -118,15 +117,20 @@ static void draw_capstone(SDL_Surface *screen, struct quirc *q, int index)
 	int j;
 	char buf[8];
 
-	for (j = 0; j < 4; j++) {
-		struct quirc_point *p0 = &cap->corners[j];
-		struct quirc_point *p1 = &cap->corners[(j + 1) % 4];
+	/* Capstones which weren't part of a plausible grid are never
+	 * located, and have only an approximate center.
+	 */
+	if (cap->located) {
+		for (j = 0; j < 4; j++) {
+			struct quirc_point *p0 = &cap->corners[j];
+			struct quirc_point *p1 = &cap->corners[(j + 1) % 4];
 
-		lineColor(screen, p0->x, p0->y, p1->x, p1->y,
-			  0x800080ff);
-	}
+			lineColor(screen, p0->x, p0->y, p1->x, p1->y,
+				  0x800080ff);
+		}
 
-	draw_blob(screen, cap->corners[0].x, cap->corners[0].y);
+		draw_blob(screen, cap->corners[0].x, cap->corners[0].y);
+	}
 
 	if (cap->qr_grid < 0) {
 		snprintf(buf, sizeof(buf), "?%d", index);
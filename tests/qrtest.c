@@ -15,6 +15,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
@@ -30,6 +31,16 @@
 
 static int want_verbose = 0;
 static int want_cell_dump = 0;
+static int want_adaptive = 0;
+static int num_threads = 1;
+static int min_module_size = 1;
+static int pyramid_factor = 1;
+static int want_rois = 0;
+static int outside_level;
+static int want_limits = 0;
+static int max_regions;
+static int max_capstones;
+static int max_grids;
 
 #define MS(ts) (unsigned int)((ts.tv_sec * 1000) + (ts.tv_nsec / 1000000))
 
@@ -79,6 +90,90 @@ static void add_result(struct result_info *sum, struct result_info *inf)
 	sum->total_time += inf->total_time;
 }
 
+static int in_rects(const struct quirc_rect *rects, int count, int x, int y)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (x >= rects[i].x && x < rects[i].x + rects[i].w &&
+		    y >= rects[i].y && y < rects[i].y + rects[i].h)
+			return 1;
+
+	return 0;
+}
+
+/* Find the codes in the image just loaded with a plain scan, then load
+ * it again, restrict the decoder to rectangles around those codes and
+ * paint everything outside them with outside_level. What quirc_end()
+ * finds then shouldn't depend on the level chosen.
+ */
+static int restrict_to_codes(int (*loader)(struct quirc *, const char *),
+			     const char *path)
+{
+	struct quirc_rect *rects;
+	uint8_t *image;
+	int count;
+	int w, h;
+	int x, y;
+	int i;
+
+	quirc_set_rois(decoder, NULL, 0);
+	quirc_end(decoder);
+
+	count = quirc_count(decoder);
+	if (!count)
+		return 0;
+
+	rects = malloc(sizeof(*rects) * count);
+	if (!rects) {
+		perror("malloc");
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct quirc_code code;
+		int x0, y0, x1, y1;
+		int margin;
+		int j;
+
+		quirc_extract(decoder, i, &code);
+		x0 = x1 = code.corners[0].x;
+		y0 = y1 = code.corners[0].y;
+		for (j = 1; j < 4; j++) {
+			if (code.corners[j].x < x0)
+				x0 = code.corners[j].x;
+			if (code.corners[j].x > x1)
+				x1 = code.corners[j].x;
+			if (code.corners[j].y < y0)
+				y0 = code.corners[j].y;
+			if (code.corners[j].y > y1)
+				y1 = code.corners[j].y;
+		}
+
+		/* Enough for the quiet zone of a version 1 code */
+		margin = ((x1 - x0 > y1 - y0 ? x1 - x0 : y1 - y0) + 3) / 4;
+		rects[i].x = x0 - margin;
+		rects[i].y = y0 - margin;
+		rects[i].w = x1 - x0 + 1 + margin * 2;
+		rects[i].h = y1 - y0 + 1 + margin * 2;
+	}
+
+	if (loader(decoder, path) < 0 ||
+	    quirc_set_rois(decoder, rects, count) < 0) {
+		free(rects);
+		return -1;
+	}
+
+	image = quirc_begin(decoder, &w, &h);
+	for (y = 0; y < h; y++)
+		for (x = 0; x < w; x++)
+			if (!in_rects(rects, count, x, y))
+				image[y * w + x] = outside_level;
+
+	free(rects);
+	return 0;
+}
+
 static int scan_file(const char *path, const char *filename,
 		     struct result_info *info)
 {
@@ -104,6 +199,8 @@ static int scan_file(const char *path, const char *filename,
 	(void)clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tp);
 	total_start = start = MS(tp);
 	ret = loader(decoder, path);
+	if (ret >= 0 && want_rois)
+		ret = restrict_to_codes(loader, path);
 	(void)clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tp);
 	info->load_time = MS(tp) - start;
 
@@ -256,6 +353,43 @@ static int run_tests(int argc, char **argv)
 		return -1;
 	}
 
+	if (want_adaptive &&
+	    quirc_set_threshold_mode(decoder, QUIRC_THRESHOLD_ADAPTIVE) < 0) {
+		perror("quirc_set_threshold_mode");
+		quirc_destroy(decoder);
+		return -1;
+	}
+
+	if (want_limits &&
+	    quirc_set_limits(decoder, max_regions, max_capstones,
+			     max_grids) < 0) {
+		fprintf(stderr, "quirc_set_limits: invalid limits %d,%d,%d\n",
+			max_regions, max_capstones, max_grids);
+		quirc_destroy(decoder);
+		return -1;
+	}
+
+	if (quirc_set_threads(decoder, num_threads) < 0) {
+		fprintf(stderr, "quirc_set_threads: can't use %d threads\n",
+			num_threads);
+		quirc_destroy(decoder);
+		return -1;
+	}
+
+	if (quirc_set_min_module_size(decoder, min_module_size) < 0) {
+		fprintf(stderr, "quirc_set_min_module_size: invalid size %d\n",
+			min_module_size);
+		quirc_destroy(decoder);
+		return -1;
+	}
+
+	if (quirc_set_pyramid(decoder, pyramid_factor) < 0) {
+		fprintf(stderr, "quirc_set_pyramid: invalid factor %d\n",
+			pyramid_factor);
+		quirc_destroy(decoder);
+		return -1;
+	}
+
 	printf("  %-30s  %17s %11s\n", "", "Time (ms)", "Count");
 	printf("  %-30s  %5s %5s %5s %5s %5s\n",
 	       "Filename", "Load", "ID", "Total", "ID", "Dec");
@@ -288,12 +422,48 @@ int main(int argc, char **argv)
 	printf("Library version: %s\n", quirc_version());
 	printf("\n");
 
-	while ((opt = getopt(argc, argv, "vd")) >= 0)
+	while ((opt = getopt(argc, argv, "vdat:m:p:l:r:")) >= 0)
 		switch (opt) {
 		case 'v':
 			want_verbose = 1;
 			break;
 
+		case 'a':
+			want_adaptive = 1;
+			break;
+
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+
+		case 'm':
+			min_module_size = atoi(optarg);
+			break;
+
+		case 'p':
+			pyramid_factor = atoi(optarg);
+			break;
+
+		case 'r':
+			outside_level = atoi(optarg);
+			if (outside_level < 0 || outside_level > UINT8_MAX) {
+				fprintf(stderr, "-r: expected a level from "
+					"0 to 255\n");
+				return -1;
+			}
+			want_rois = 1;
+			break;
+
+		case 'l':
+			if (sscanf(optarg, "%d,%d,%d", &max_regions,
+				   &max_capstones, &max_grids) != 3) {
+				fprintf(stderr, "-l: expected "
+					"regions,capstones,grids\n");
+				return -1;
+			}
+			want_limits = 1;
+			break;
+
 		case 'd':
 			want_cell_dump = 1;
 			break;